@@ -0,0 +1,90 @@
+#!/usr/bin/env python3
+"""Convert Silero VAD v5 PyTorch weights (silero_vad.jit) into the native LATE VAD format.
+
+    python3 convert_silero_vad.py silero_vad.jit models/silero_vad_v5.bin
+
+With --reference WAV OUT, writes per-window speech probabilities of the PyTorch model as float32,
+which `late --vad-parity WAV --vad-reference OUT` compares against the native engine.
+In a build with ONNX Runtime, `late --vad NATIVE.bin --vad-parity WAV --vad-reference-model silero_vad.onnx`
+compares the native engine against the ONNX model on the same input.
+"""
+
+import argparse
+import struct
+import sys
+
+import numpy as np
+import torch
+
+MAGIC = b'SLRV'
+VERSION = 1
+# source prefix and native name prefix of the 16 and 8 kHz branches
+BRANCHES = [('_model.', ''), ('_model_8k.', '8k.')]
+
+NAMES = [
+    'stft.forward_basis_buffer',
+    *[f'encoder.{i}.reparam_conv.{p}' for i in range(4) for p in ('weight', 'bias')],
+    'decoder.rnn.weight_ih', 'decoder.rnn.weight_hh', 'decoder.rnn.bias_ih', 'decoder.rnn.bias_hh',
+    'decoder.decoder.2.weight', 'decoder.decoder.2.bias',
+]
+
+
+def convert(model, out_path):
+    state = model.state_dict()
+    tensors = []
+    for prefix, native_prefix in BRANCHES:
+        missing = [prefix + name for name in NAMES if prefix + name not in state]
+        if missing and not native_prefix:
+            sys.exit(f'tensor {missing[0]} not found, is this a Silero VAD v5 model?')
+        if missing:
+            print('no 8 kHz branch, the model will run at 16 kHz only')
+            continue
+        tensors += [(native_prefix + name, state[prefix + name]) for name in NAMES]
+    with open(out_path, 'wb') as f:
+        f.write(MAGIC)
+        f.write(struct.pack('<II', VERSION, len(tensors)))
+        for name, tensor in tensors:
+            data = tensor.detach().float().numpy()
+            encoded = name.encode()
+            f.write(struct.pack('<I', len(encoded)))
+            f.write(encoded)
+            f.write(struct.pack('<I', data.ndim))
+            f.write(struct.pack(f'<{data.ndim}I', *data.shape))
+            f.write(data.astype('<f4').tobytes())
+            print(f'{name}: {list(data.shape)}')
+
+
+def reference(model, wav_path, out_path):
+    import wave
+    with wave.open(wav_path) as w:
+        rate = w.getframerate()
+        if rate not in (16000, 8000) or w.getnchannels() != 1 or w.getsampwidth() != 2:
+            sys.exit('reference input must be 16 or 8 kHz mono 16-bit wav')
+        samples = np.frombuffer(w.readframes(w.getnframes()), dtype='<i2').astype(np.float32) / 32768.0
+    window = 512 if rate == 16000 else 256
+    model.reset_states()
+    probs = []
+    with torch.no_grad():
+        for i in range(0, len(samples) - window + 1, window):
+            probs.append(model(torch.from_numpy(samples[i:i + window]), rate).item())
+    np.asarray(probs, dtype='<f4').tofile(out_path)
+    print(f'{len(probs)} window probabilities written to {out_path}')
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('model', help='Silero VAD v5 TorchScript model (silero_vad.jit)')
+    parser.add_argument('output', nargs='?', help='native model output path')
+    parser.add_argument('--reference', nargs=2, metavar=('WAV', 'OUT'), help='write reference probabilities for a wav file')
+    args = parser.parse_args()
+
+    model = torch.jit.load(args.model, map_location='cpu')
+    model.eval()
+    if args.output:
+        convert(model, args.output)
+    if args.reference:
+        reference(model, *args.reference)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,132 @@
+#pragma once
+
+#include <deque>
+#include <mutex>
+#include <optional>
+#include <condition_variable>
+#include <chrono>
+#include <functional>
+#include <algorithm>
+
+
+// Multi-producer multi-consumer queue guarded by a single mutex, consumers block until an item is available or
+// the queue is closed. Priority items are served before normal ones, but keep their order among themselves.
+// With capacity > 0 producers block while the queue is full. A selector may pick the next normal item instead of the first.
+template <typename T>
+class BlockingQueue {
+public:
+    BlockingQueue(size_t capacity = 0) : capacity(capacity) {}
+
+    BlockingQueue(const BlockingQueue&) = delete;
+    BlockingQueue& operator=(const BlockingQueue&) = delete;
+
+    // returns index of the next item to serve among items[first..], called with the queue locked
+    typedef std::function<size_t(const std::deque<T>& items, size_t first)> Selector;
+
+    void set_selector(Selector selector) {
+        std::lock_guard<std::mutex> lock(mutex);
+        this->selector = std::move(selector);
+    }
+
+    // returns false if the queue is closed
+    bool push(T&& item, bool priority = false) {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            if (capacity > 0)
+                not_full.wait(lock, [&] { return closed || items.size() < capacity; });
+            if (closed)
+                return false;
+            if (priority)
+                items.insert(items.begin() + n_priority++, std::move(item));
+            else
+                items.push_back(std::move(item));
+        }
+        not_empty.notify_one();
+        return true;
+    }
+
+    bool push(const T& item, bool priority = false) { return push(T(item), priority); }
+
+    // blocks until an item is available, returns nothing once the queue is closed and drained
+    std::optional<T> pop() {
+        std::unique_lock<std::mutex> lock(mutex);
+        not_empty.wait(lock, [&] { return closed || !items.empty(); });
+        return take(lock);
+    }
+
+    // like pop(), but gives up after timeout
+    template <class Rep, class Period>
+    std::optional<T> pop_for(const std::chrono::duration<Rep, Period>& timeout) {
+        std::unique_lock<std::mutex> lock(mutex);
+        not_empty.wait_for(lock, timeout, [&] { return closed || !items.empty(); });
+        return take(lock);
+    }
+
+    std::optional<T> try_pop() {
+        std::unique_lock<std::mutex> lock(mutex);
+        return take(lock);
+    }
+
+    // removes the first item matching the predicate
+    template <class Predicate>
+    std::optional<T> take_if(Predicate predicate) {
+        std::unique_lock<std::mutex> lock(mutex);
+        for (auto it = items.begin(); it != items.end(); ++it) {
+            if (predicate(*it)) {
+                if ((size_t)(it - items.begin()) < n_priority)
+                    n_priority--;
+                T item = std::move(*it);
+                items.erase(it);
+                lock.unlock();
+                not_full.notify_one();
+                return item;
+            }
+        }
+        return std::nullopt;
+    }
+
+    // calls f for every queued item in the order they will be served
+    template <class F>
+    void for_each(F f) {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (auto& item : items)
+            f(item);
+    }
+
+    // wakes all consumers and producers, remaining items can still be popped
+    void close() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            closed = true;
+        }
+        not_empty.notify_all();
+        not_full.notify_all();
+    }
+
+    bool is_closed() const { std::lock_guard<std::mutex> lock(mutex); return closed; }
+    size_t size() const { std::lock_guard<std::mutex> lock(mutex); return items.size(); }
+    bool empty() const { std::lock_guard<std::mutex> lock(mutex); return items.empty(); }
+
+private:
+    std::optional<T> take(std::unique_lock<std::mutex>& lock) {
+        if (items.empty())
+            return std::nullopt;
+        size_t index = n_priority == 0 && selector ? std::min(selector(items, 0), items.size() - 1) : 0;
+        T item = std::move(items[index]);
+        items.erase(items.begin() + index);
+        if (n_priority > 0)
+            n_priority--;
+        lock.unlock();
+        not_full.notify_one();
+        return item;
+    }
+
+    mutable std::mutex mutex;
+    std::condition_variable not_empty;
+    std::condition_variable not_full;
+    std::deque<T> items;
+    size_t n_priority = 0;  // priority items at the front
+    Selector selector;
+    size_t capacity = 0;    // 0 - unbounded
+    bool closed = false;
+};
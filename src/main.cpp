@@ -12,8 +12,13 @@
 #include <string>
 #include <type_traits>
 #include <regex>
+#include <thread>
+#include <ctime>
+#include <iomanip>
+#include <locale>
 
 #include <cstring>
+#include <cmath>
 #include <cstdlib>
 #include <csignal>
 
@@ -38,6 +43,7 @@
 #include "string_util.hpp"
 #include "vfs.hpp"
 #include "engine_device_conf.hpp"
+#include "blocking-queue.hpp"
 
 
 using namespace std;
@@ -113,6 +119,73 @@ bool contains(std::string_view str, std::string_view substr) {
     return str.find(substr) != std::string_view::npos;
 }
 
+std::string jobStatusString(WhisperJobStatus status) {
+    if (status == WhisperJobStatus::Waiting)
+        return "waiting";
+    else if (status == WhisperJobStatus::Running)
+        return "running";
+    else if (status == WhisperJobStatus::Failed)
+        return "failed";
+    else if (status == WhisperJobStatus::Aborted)
+        return "aborted";
+    else if (status == WhisperJobStatus::Done)
+        return "done";
+    return "unknown";
+}
+
+std::optional<WhisperJobStatus> parseJobStatus(const std::string& status) {
+    if (status == "waiting")
+        return WhisperJobStatus::Waiting;
+    else if (status == "running")
+        return WhisperJobStatus::Running;
+    else if (status == "failed")
+        return WhisperJobStatus::Failed;
+    else if (status == "aborted")
+        return WhisperJobStatus::Aborted;
+    else if (status == "done")
+        return WhisperJobStatus::Done;
+    return std::nullopt;
+}
+
+// RFC 7231 date, as in Last-Modified
+std::string httpDate(time_t t) {
+    struct tm tm;
+    gmtime_r(&t, &tm);
+    std::ostringstream out;
+    out.imbue(std::locale::classic());
+    out << std::put_time(&tm, "%a, %d %b %Y %H:%M:%S GMT");
+    return out.str();
+}
+
+std::optional<time_t> parseHttpDate(const std::string& date) {
+    struct tm tm = {};
+    std::istringstream in(date);
+    in.imbue(std::locale::classic());
+    in >> std::get_time(&tm, "%a, %d %b %Y %H:%M:%S");
+    if (in.fail())
+        return std::nullopt;
+    return timegm(&tm);
+}
+
+// conditional GET: If-None-Match takes precedence over If-Modified-Since
+bool notModified(const httplib::Request& req, const std::string& etag, time_t modified) {
+    if (req.has_header("If-None-Match")) {
+        for (auto tag : splitString(req.get_header_value("If-None-Match"), ",")) {
+            trim(tag);
+            if (starts_with(tag, "W/"))
+                tag = tag.substr(2);
+            if (tag == etag || tag == "*")
+                return true;
+        }
+        return false;
+    }
+    if (req.has_header("If-Modified-Since")) {
+        if (auto since = parseHttpDate(req.get_header_value("If-Modified-Since")); since)
+            return modified <= since.value();
+    }
+    return false;
+}
+
 bool is_directory(const fs::path p) {
     return fs::is_directory(p) || (fs::is_symlink(p) && fs::is_directory(fs::read_symlink(p)));
 }
@@ -211,6 +284,33 @@ struct ServerConfig {
     int limit_whisper_input_s = 0;
     int vad_trim_range_s = 20;
     int max_whisper_instances = 2;
+    int max_whisper_states = 0;         // 0 - max_whisper_instances + 1 (one for synchronous requests)
+    int whisper_state_wait_ms = 30000;  // synchronous requests wait this long for a free whisper state, then fail with 503
+    bool split_ranges = false;          // transcribe speech ranges of a single queued job in parallel
+    bool pack_ranges = true;            // pack short VAD speech ranges into full whisper windows
+    int job_ttl_s = 24 * 3600;          // keep results of finished queued jobs in memory, and then in the database, this long (0 - forever)
+    int job_retention_mb = 512;         // memory budget for results of finished queued jobs (0 - unlimited)
+    bool spill_job_results = true;      // store evicted job results in the database, so that they can still be fetched
+    std::string schedule = "sjf";       // queued job scheduling: fifo or sjf (shortest first with aging)
+    bool fair_share = false;            // share processors fairly between clients
+    double schedule_aging = 10.0;       // seconds of audio duration forgiven per second of waiting (sjf)
+    bool preemption = true;             // long running jobs yield to more urgent ones at speech range boundaries
+    int max_queued_jobs = 200;          // admission limits on waiting queued jobs, over them requests get 429 (0 - unlimited)
+    double max_queued_audio_h = 24.0;   // hours of audio
+    int max_queued_mb = 8192;           // sample memory
+    int queue_resident_mb = 1024;       // audio of waiting queued jobs kept in memory, the rest is spilled to files (0 - never spill)
+    int vad_threads = 1;                // compute VAD of long queued jobs in parallel chunks on this many threads
+    bool vad_energy_gate = true;        // skip VAD inference on windows of digital silence
+    bool vad_8k = true;                 // run VAD of 8 kHz (telephony) audio at 8 kHz instead of on the upsampled input
+    float vad_energy_floor_db = -70;    // RMS floor of the energy gate in dBFS
+    int vad_batch = 32;                 // run VAD windows of concurrent synchronous requests in batches of up to N (0 - no batching)
+    int vad_intra_threads = 1;          // ONNX Runtime threads of a single VAD model run
+    int vad_inter_threads = 1;
+    int vad_sessions = 0;               // concurrent VAD model runs (0 - hardware threads / intra threads)
+    int vad_cache_entries = 256;        // speech range lists of recently processed audio kept in memory (0 - no VAD range cache)
+    int vad_cache_ttl_s = 7 * 24 * 3600;    // stored speech ranges of audio without a document are kept this long (0 - forever)
+    bool vad_precompute = true;         // detect speech ranges of uploaded document audio in the background
+    bool adaptive_audio_ctx = true;     // reduce whisper encoder context for short synchronous (mic) inputs
     bool cpu_only = false;
     bool add_cors_headers = false;
 };
@@ -229,9 +329,146 @@ void runServer(logger& log, const ServerConfig& config = ServerConfig())
     Server server;
     Storage storage("storage.sqlite");
 
-    VADModel vad_model(config.vad_model_path);
+    VADEngineConfig vad_engine;
+    vad_engine.intra_threads = config.vad_intra_threads;
+    vad_engine.inter_threads = config.vad_inter_threads;
+    vad_engine.sessions = config.vad_sessions;
+    VADModel vad_model(config.vad_model_path, vad_engine);
+    if (config.vad_batch > 1)
+        vad_model.setBatching(config.vad_batch);
     WhisperModel whisperModel(config.whisper_model_path, config.whisper_dtw, engineDeviceConf.IsGPU(Engines::Whisper), engineDeviceConf[Engines::Whisper] /*, use_gpu, gpu_device */);
+    int max_whisper_states = config.max_whisper_states > 0 ? config.max_whisper_states : config.max_whisper_instances + 1;
+    log.info("whisper state pool size: {}", max_whisper_states);
+    whisperModel.configureStatePool(max_whisper_states, 1 /* prewarm one state for the synchronous path */);
     WhisperQueueProcessor whisper(whisperModel, vad_model, config.max_whisper_instances);
+    whisper.setSplitRanges(config.split_ranges);
+    if (config.split_ranges)
+        log.info("speech ranges of a single job are transcribed in parallel");
+    whisper.setScheduling(config.schedule == "fifo" ? WhisperSchedulingPolicy::FIFO : WhisperSchedulingPolicy::ShortestFirst,
+            config.fair_share, config.schedule_aging);
+    whisper.setPreemption(config.preemption);
+    log.info("queued job scheduling: {}{}", config.schedule == "fifo" ? "fifo" : "shortest first", config.fair_share ? ", fair share" : "");
+    whisper.setAdmissionLimits(config.max_queued_jobs, config.max_queued_audio_h * 3600, (size_t)config.max_queued_mb * 1024 * 1024);
+    whisper.setRetention(config.job_ttl_s, (size_t)config.job_retention_mb * 1024 * 1024);
+    if (config.queue_resident_mb > 0 && !storage.file_path().empty()) {
+        auto queue_path = fs::path(storage.file_path()) / "queue";
+        whisper.setAudioSpill(queue_path.string(), (size_t)config.queue_resident_mb * 1024 * 1024);
+        log.info("audio of waiting jobs over {} MB is spilled to {}", config.queue_resident_mb, queue_path.string());
+    }
+    if (config.spill_job_results) {
+        whisper.setSpill([&](const WhisperJobID& id, WhisperJobStatus status, const WhisperSegments& segments) -> bool {
+            string data;
+            for (auto& segment : segments) {
+                data += segment.to_json().dump(-1, ' ', false, json::error_handler_t::ignore);
+                data += "\n";
+            }
+            if (config.job_ttl_s > 0)
+                storage.remove_expired_job_results(config.job_ttl_s);
+            return storage.put_job_result(id, jobStatusString(status), data);
+        }, [&](const WhisperJobID& id) -> std::optional<std::pair<WhisperJobStatus, WhisperSegments>> {
+            auto result = storage.get_job_result(id);
+            if (!result)
+                return std::nullopt;
+            auto status = parseJobStatus(result.value().first);
+            if (!status)
+                return std::nullopt;
+            WhisperSegments segments;
+            try {
+                for (auto& line : splitString(result.value().second, "\n")) {
+                    if (!line.empty())
+                        segments.emplace_back(WhisperSegment::from_json(json::parse(line)));
+                }
+            } catch (const std::exception& e) {
+                log.error("unable to parse stored results of job {}: {}", id, e.what());
+                return std::nullopt;
+            }
+            return std::make_pair(status.value(), std::move(segments));
+        });
+    }
+
+    // VAD configuration of all transcriptions, speech ranges are cached per audio content and this configuration;
+    // 8 kHz (telephony) audio is detected by the model's 8 kHz branch on the 16 kHz whisper input
+    const auto serverVADConfig = [&](unsigned int source_sample_rate = 0) {
+        VADConfig vad_config;
+        vad_config.parallel_threads = config.vad_threads;
+        vad_config.energy_gate = config.vad_energy_gate;
+        vad_config.energy_floor_db = config.vad_energy_floor_db;
+        if (config.vad_8k && source_sample_rate == 8000 && vad_model.supports(8000)) {
+            vad_config.sample_rate = 8000;
+            vad_config.input_sample_rate = 16000;     // whisper input
+        }
+        return vad_config;
+    };
+
+    // re-transcriptions of the same audio reuse its speech ranges, persisted as [[start, end], ...] next to the documents
+    std::shared_ptr<VADRangeCache> vad_cache;
+    if (config.vad_cache_entries > 0 && vad_model) {
+        vad_cache = std::make_shared<VADRangeCache>(config.vad_cache_entries);
+        vad_cache->setStore([&](const std::string& key, const std::string& owner, const std::vector<speech_range>& ranges) -> bool {
+            json data = json::array();
+            for (auto& range : ranges)
+                data.push_back({range.start, range.end});
+            if (config.vad_cache_ttl_s > 0)
+                storage.remove_expired_vad_ranges(config.vad_cache_ttl_s);
+            return storage.put_vad_ranges(key, owner, data.dump());
+        }, [&](const std::string& key) -> std::optional<std::vector<speech_range>> {
+            auto data = storage.get_vad_ranges(key);
+            if (!data)
+                return std::nullopt;
+            std::vector<speech_range> ranges;
+            try {
+                for (auto& range : json::parse(data.value()))
+                    ranges.emplace_back(range[0].get<int>(), range[1].get<int>());
+            } catch (const std::exception& e) {
+                log.error("unable to parse stored VAD ranges: {}", e.what());
+                return std::nullopt;
+            }
+            return ranges;
+        });
+        whisper.setVADCache(vad_cache);
+    }
+
+    // document audio is stored in the uploaded container, a single file per document
+    const AudioFormat audio_formats[] = { AudioFormat::WAV, AudioFormat::FLAC, AudioFormat::MP3, AudioFormat::Ogg };
+    const auto findAudioFormat = [&](const std::string& id) -> std::optional<AudioFormat> {
+        for (auto format : audio_formats) {
+            if (storage.has_file(id, audio_format_extension(format)))
+                return format;
+        }
+        return std::nullopt;
+    };
+
+    // speech ranges of uploaded document audio are detected ahead of its first transcription
+    BlockingQueue<std::string> vad_precompute_queue;
+    std::thread vad_precompute_thread;
+    if (vad_cache && config.vad_precompute) {
+        vad_precompute_thread = std::thread([&] {
+            while (auto id = vad_precompute_queue.pop()) {
+                auto format = findAudioFormat(id.value());
+                auto file = format ? storage.get_file(id.value(), audio_format_extension(format.value())) : std::nullopt;
+                if (!file)
+                    continue;
+                PCMBuffer pcm(file.value().data, file.value().size);
+                if (!pcm)
+                    continue;
+                VAD vad(vad_model, serverVADConfig(pcm.source_sample_rate()));
+                auto key = vad.cache_key(pcm.samples(), pcm.count());
+                if (vad_cache->get(key))
+                    continue;
+                std::vector<speech_range> ranges;
+                try {
+                    vad.start(pcm.samples(), pcm.count());
+                    for (auto& range : vad)
+                        ranges.push_back(range);
+                } catch (const std::exception& e) {
+                    log.error("VAD of audio for document with id = {} failed: {}", id.value(), e.what());
+                    continue;
+                }
+                vad_cache->put(key, ranges, id.value());
+                log.debug("{} speech ranges precomputed for document with id = {}", ranges.size(), id.value());
+            }
+        });
+    }
 
     server.Get("/api/config", [&](const auto& req, auto& res) {
         json config_json = {
@@ -341,27 +578,70 @@ void runServer(logger& log, const ServerConfig& config = ServerConfig())
             return;
         }
 
-        if (!storage.put_file(id, req.body.c_str(), req.body.size(), ".wav")) {
+        // compressed uploads are kept as they are and decoded on use
+        auto format = detect_audio_format(req.body.c_str(), req.body.size());
+        if (format == AudioFormat::Unknown) {
+            log.warn("unsupported audio format for document with id = {}", id);
+            res.status = 415;
+            return;
+        }
+
+        if (!storage.put_file(id, req.body.c_str(), req.body.size(), audio_format_extension(format))) {
             log.error("error storing audio for document with id = {}", id);
             res.status = 500;
             return;
         }
 
+        // replaces audio of the document stored in another format
+        for (auto other : audio_formats) {
+            if (other != format)
+                storage.remove_file(id, audio_format_extension(other));
+        }
+
+        if (vad_precompute_thread.joinable())
+            vad_precompute_queue.push(id);
+
         res.status = 204;
     });
 
     server.Get("/api/storage/([^/]+)/audio", [&](const auto& req, auto& res) {
         std::string id = req.matches[1];
 
-        auto result = storage.get_file(id, ".wav");
+        auto format = findAudioFormat(id);
+        auto file = format ? storage.map_file(id, audio_format_extension(format.value())) : std::nullopt;
 
-        if (!result) {
+        if (!file) {
             log.error("audio for document with id = {} not found", id);
             res.status = 404;
             return;
         }
 
-        res.set_content((const char *)result.value().data, result.value().size, "audio/wav");
+        // audio may be replaced under the same URL, so clients revalidate with the ETag
+        std::ostringstream etag;
+        etag << '"' << std::hex << file->size << '-' << file->modified_s << '.' << file->modified_ns << '"';
+        res.set_header("ETag", etag.str());
+        res.set_header("Last-Modified", httpDate(file->modified_s));
+        res.set_header("Cache-Control", "no-cache");
+        res.set_header("Accept-Ranges", "bytes");
+
+        if (notModified(req, etag.str(), file->modified_s)) {
+            res.status = 304;
+            return;
+        }
+
+        const char* mime_type = audio_format_mime_type(format.value());
+
+        if (file->size == 0) {
+            res.set_content("", mime_type);
+            return;
+        }
+
+        // served straight from the mapped file in chunks, httplib slices Range requests (206) out of the provider
+        auto data = file->data;
+        res.set_content_provider(file->size, mime_type, [data](size_t offset, size_t length, DataSink& sink) {
+            const size_t chunk = 256 * 1024;
+            return sink.write((const char*)data.get() + offset, std::min(length, chunk));
+        });
     });
 
     server.Delete("/api/storage/([^/]+)/audio", [&](const auto& req, auto& res) {
@@ -381,15 +661,75 @@ void runServer(logger& log, const ServerConfig& config = ServerConfig())
             return;
         }
 
-        if (!storage.remove_file(id, ".wav")) {
+        auto format = findAudioFormat(id);
+        if (!format || !storage.remove_file(id, audio_format_extension(format.value()))) {
             log.error("unable to remove audio file for document with id = {}", id);
             res.status = 404;
             return;
         }
 
+        storage.remove_vad_ranges(id);
+
         res.status = 204;
     });
 
+    server.Get("/api/whisper/stats", [&](const auto& req, auto& res) {
+        auto stats = whisper.getStats();
+        json vad_sessions = json::array();
+        for (auto& session : vad_model.sessionStats())
+            vad_sessions.push_back(json{{"runs", session.runs}, {"busy_s", session.busy_s}, {"wait_s", session.wait_s}});
+        json stats_json = {
+            {"jobs", stats.jobs},
+            {"retained_bytes", stats.retained_bytes},
+            {"evicted", stats.evicted},
+            {"spilled", stats.spilled},
+            {"restored", stats.restored},
+            {"preempted", stats.preempted},
+            {"queued_jobs", stats.queued_jobs},
+            {"queued_audio_s", stats.queued_audio_s},
+            {"queued_bytes", stats.queued_bytes},
+            {"rejected", stats.rejected},
+            {"spilled_audio", stats.spilled_audio},
+            {"vad_windows", vad_model.gateStats().windows},
+            {"vad_skipped_windows", vad_model.gateStats().skipped},
+            {"vad_batches", vad_model.batchStats().batches},
+            {"vad_batched_windows", vad_model.batchStats().windows},
+            {"vad_cached_ranges", vad_cache ? vad_cache->stats().entries : 0},
+            {"vad_cache_hits", vad_cache ? vad_cache->stats().hits : 0},
+            {"vad_cache_misses", vad_cache ? vad_cache->stats().misses : 0},
+            {"vad_sessions", vad_sessions},
+        };
+        res.set_content(stats_json.dump(2), "application/json");
+    });
+
+    // lightweight pre-check before uploading: would a queued job of the given duration (s) or wav file size be admitted
+    server.Get("/api/whisper/admission", [&](const auto& req, auto& res) {
+        res.set_header("Access-Control-Allow-Origin", "*");
+        double duration = 0;
+        size_t size = 0;
+        try {
+            if (req.has_param("duration"))
+                duration = std::stod(req.get_param_value("duration"));
+            if (req.has_param("size"))
+                size = std::stoull(req.get_param_value("size"));
+        } catch (...) {
+            res.status = 400;
+            return;
+        }
+        // without duration assume 16 kHz 16-bit mono wav
+        if (duration <= 0 && size > 0)
+            duration = (double)size / (16000 * sizeof(int16_t));
+        auto admission = whisper.checkAdmission(duration);
+        json admission_json = {
+            {"accepted", admission.accepted},
+            {"retry_after", (int)std::ceil(admission.retry_after_s)},
+            {"reason", admission.reason},
+        };
+        if (!admission.accepted && !admission.permanent)
+            res.set_header("Retry-After", std::to_string((int)std::ceil(admission.retry_after_s)));
+        res.set_content(admission_json.dump(2), "application/json");
+    });
+
     server.Get("/api/whisper/([^/]+)/abort", [&](const auto& req, auto& res) {
 
         res.set_header("Access-Control-Allow-Origin", "*");
@@ -436,20 +776,22 @@ void runServer(logger& log, const ServerConfig& config = ServerConfig())
             return;
         }
 
-        std::string result;
-
-        if (status == WhisperJobStatus::Waiting)
-            result = "waiting";
-        else if (status == WhisperJobStatus::Running)
-            result = "running";
-        else if (status == WhisperJobStatus::Failed)
-            result = "failed";
-        else if (status == WhisperJobStatus::Aborted)
-            result = "aborted";
-        else if (status == WhisperJobStatus::Done)
-            result = "done";
-        else
-            result = "unknown";
+        std::string result = jobStatusString(status);
+
+        bool details = false;
+        if (req.has_param("details")) {
+            if (auto v = req.get_param_value("details"); v.size() > 0 && (v == "1" || v[0] == 'y' || v[0] == 't'))
+                details = true;
+        }
+
+        if (details) {
+            json details_json = {{"status", result}};
+            if (auto info = whisper.getQueueInfo(id); info) {
+                details_json["position"] = info.value().position;
+                details_json["eta"] = info.value().eta_s;
+            }
+            result = details_json.dump(-1, ' ', false, json::error_handler_t::ignore);
+        }
 
         res.set_content(result, "application/json");
         return;
@@ -473,22 +815,11 @@ void runServer(logger& log, const ServerConfig& config = ServerConfig())
             return;
         }
 
-        using namespace std::chrono_literals;
-
-        // TODO: convert to conditional - any job status changes
-        // while ((status = whisper.getJobStatus(id)).value_or(WhisperJobStatus::Failed) == WhisperJobStatus::Waiting)
-        //     std::this_thread::sleep_for(100ms);
-
+        // whisper.wait() blocks through waiting as well and wakes on every status change or new segment
         if (status == WhisperJobStatus::Waiting) {
             log.debug("job with id {} not yet started, waiting", id);
         }
 
-        // TODO: convert to wait condition
-        while (status == WhisperJobStatus::Waiting) {
-            std::this_thread::sleep_for(100ms);
-            status = whisper.getJobStatus(id).value();
-        }
-
         if (status != WhisperJobStatus::Running && status != WhisperJobStatus::Waiting) {
             // if (status == WhisperJobStatus::Failed) {
             //     log.debug("job with id {} failed", id);
@@ -498,8 +829,8 @@ void runServer(logger& log, const ServerConfig& config = ServerConfig())
             // }
             // we already must have results here, keep the same format
             string result;
-            if (auto opt = whisper.getResults(id); opt) {
-                auto& segments = opt.value();
+            if (auto results = whisper.getResults(id); results) {
+                auto& segments = *results;
                 for (auto& segment : segments) {
                     result += segment.to_json().dump(-1, ' ', false, json::error_handler_t::ignore);
                     result += "\n";
@@ -597,7 +928,9 @@ void runServer(logger& log, const ServerConfig& config = ServerConfig())
         // log.debug("wait handler exit");
     });
 
-    server.Post("/api/whisper", [&](const auto& req, auto& res) {
+    // the multipart body is read as it arrives: the input is decoded block by block without buffering the body,
+    // a direct transcription starts as soon as the length of the input is known (language given before the input)
+    server.Post("/api/whisper", [&](const Request& req, Response& res, const ContentReader& content_reader) {
 
         res.set_header("Access-Control-Allow-Origin", "*");
         res.set_header("Allow", "GET, POST, HEAD, OPTIONS");
@@ -612,22 +945,6 @@ void runServer(logger& log, const ServerConfig& config = ServerConfig())
             return;
         }
 
-        if (!req.has_file("input")) {
-            cerr << "request is missing 'input' file field" << endl;
-            res.status = 400;
-            return;
-        }
-
-        string lang = "auto";
-
-        if (req.has_file("lang")) {
-            lang = req.get_file_value("lang").content;
-        }
-
-        auto file = req.get_file_value("input");
-        const void* data = file.content.c_str();
-        size_t dataSize = file.content.size();
-
         bool enqueue = false;
 
         if(req.has_param("enqueue")) {
@@ -643,43 +960,191 @@ void runServer(logger& log, const ServerConfig& config = ServerConfig())
                 enqueue = true;
         }
 
-        PCMBuffer pcm(data, dataSize);
+        // a language given before the input (query or an earlier field) lets the transcription start while the input arrives
+        string lang = req.has_param("lang") ? req.get_param_value("lang") : "auto";
+        bool lang_field = false;
+
+        bool pack_ranges = config.pack_ranges;
+        bool adaptive_audio_ctx = config.adaptive_audio_ctx;
+        VADConfig vad_config = serverVADConfig();
+
+        PCMStream pcm;
+        string field;
+        bool has_input = false;
+        bool early_start = false;
+
+        // direct transcription, runs on its own thread while the input arrives
+        Whisper transcriber(whisperModel, vad_model);
+        transcriber.setVADCache(vad_cache);
+        std::thread transcription;
+        int transcription_result = 0;
+
+        const auto transcribe = [&](SampleWait wait) {
+            int state_wait_ms = config.whisper_state_wait_ms;
+
+            // short concurrent inputs share batched VAD runs
+            VADConfig direct_vad_config = vad_config;
+            direct_vad_config.batched = true;
+
+            WhisperJobConfig job_config = { .lang = lang.empty() ? "auto" : lang, .use_vad = true, .vad_config = direct_vad_config, .state_wait_ms = state_wait_ms,
+                .pack_ranges = pack_ranges, .adaptive_audio_ctx = adaptive_audio_ctx };
+
+            size_t processSampleCount =  config.limit_whisper_input_s > 0 ?
+                std::min(pcm.count(), (size_t)((config.limit_whisper_input_s + config.vad_trim_range_s) * pcm.sample_rate())) : pcm.count();
+
+            return transcriber(pcm.samples(), processSampleCount, job_config, wait);
+        };
+
+        bool received = content_reader(
+            [&](const MultipartFormData& file) {
+                field = file.name;
+                if (field == "input") {
+                    // only the first input is used
+                    if (has_input)
+                        field.clear();
+                    has_input = true;
+                    early_start = !enqueue && (req.has_param("lang") || lang_field);
+                } else if (field == "lang") {
+                    // the query language wins, a running transcription keeps its language
+                    if (req.has_param("lang") || early_start) {
+                        field.clear();
+                    } else {
+                        lang.clear();
+                        lang_field = true;
+                    }
+                }
+                return true;
+            },
+            [&](const char* data, size_t size) {
+                if (field == "input") {
+                    if (!pcm.write(data, size))
+                        return false;
+                    if (early_start && !transcription.joinable() && pcm.streaming()) {
+                        log.debug("transcription started with {} of {} samples received", pcm.available(), pcm.count());
+                        vad_config = serverVADConfig(pcm.source_sample_rate());
+                        transcription = std::thread([&] {
+                            transcription_result = transcribe([&](size_t n) { return pcm.wait(n); }).exit_code;
+                        });
+                    }
+                } else if (field == "lang" && lang.size() + size <= 64) {
+                    lang.append(data, size);
+                }
+                return true;
+            });
+
+        // an interrupted upload stops the transcription, finish() wakes it up if it waits for samples
+        if (!received && transcription.joinable())
+            transcriber.abort();
+
+        pcm.finish();
+
+        bool transcription_started = transcription.joinable();
+        if (transcription_started)
+            transcription.join();
+
+        // a streamed WAV header with an unsupported sample rate stops receiving
+        if (!received && pcm.source_sample_rate() != 0 && !supported_sample_rate(pcm.source_sample_rate())) {
+            log.warn("unsupported input sample rate {} Hz", pcm.source_sample_rate());
+            res.status = 415;
+            return;
+        }
+
+        if (!received) {
+            cerr << "error receiving request body" << endl;
+            res.status = 400;
+            return;
+        }
+
+        if (!has_input) {
+            cerr << "request is missing 'input' file field" << endl;
+            res.status = 400;
+            return;
+        }
+
+        if (lang.empty())
+            lang = "auto";
+
+        if (!pcm && pcm.source_sample_rate() != 0 && !supported_sample_rate(pcm.source_sample_rate())) {
+            log.warn("unsupported input sample rate {} Hz", pcm.source_sample_rate());
+            res.status = 415;
+            return;
+        }
 
         if (!pcm) {
-            cerr << "error decoding input as wav" << endl;
+            cerr << "error decoding input as wav, flac or mp3" << endl;
             res.status = 400;
             return;
         }
 
-        size_t processSampleCount =  config.limit_whisper_input_s > 0 ?
-            std::min(pcm.count(), (size_t)((config.limit_whisper_input_s + config.vad_trim_range_s) * pcm.sample_rate())) : pcm.count();
+        if (pcm.source_sample_rate() != pcm.sample_rate() || pcm.source_channels() != 1)
+            log.debug("{} input converted from {} Hz, {} channel(s) to {} Hz mono", audio_format_extension(pcm.format()),
+                    pcm.source_sample_rate(), pcm.source_channels(), pcm.sample_rate());
+
+        if (!transcription_started)
+            vad_config = serverVADConfig(pcm.source_sample_rate());
 
         if (enqueue) {
 
             // TODO: how to reduce buffer to processSampleCount
 
-            WhisperJobConfig config = { .lang = lang, .use_vad = true };
+            WhisperJobConfig config = { .lang = lang, .use_vad = true, .vad_config = vad_config, .pack_ranges = pack_ranges };
 
             WhisperJob job = { .samples = std::move(pcm.share()), .config = config };
 
-            auto id = whisper.add(std::move(job));
+            // explicit priority and fair share key (document, key, or the client address)
+            if (req.has_param("priority")) {
+                try {
+                    job.priority = std::stoi(req.get_param_value("priority"));
+                } catch (...) {
+                    log.warn("invalid job priority: {}", req.get_param_value("priority"));
+                }
+            }
+            if (req.has_param("client"))
+                job.client = req.get_param_value("client");
+            else if (req.has_param("doc"))
+                job.client = req.get_param_value("doc");
+            else if (req.has_param("key"))
+                job.client = req.get_param_value("key");
+            else
+                job.client = req.remote_addr;
+
+            WhisperAdmission admission;
+            auto id = whisper.tryAdd(std::move(job), admission);
+
+            if (!id) {
+                // the job alone is over the limits (413) or the queue is full for now (429)
+                int retry_after = (int)std::ceil(admission.retry_after_s);
+                log.warn("queued job rejected: {} limit, retry after {}s", admission.reason, retry_after);
+                if (!admission.permanent)
+                    res.set_header("Retry-After", std::to_string(retry_after));
+                res.status = admission.permanent ? 413 : 429;
+                res.set_content(json{{"error", admission.permanent ? "input too large" : "queue full"}, {"reason", admission.reason},
+                        {"retry_after", retry_after}}.dump(2), "application/json");
+                return;
+            }
 
-            string result = json{{"id", id}}.dump(2, ' ', false, json::error_handler_t::ignore);
+            string result = json{{"id", *id}}.dump(2, ' ', false, json::error_handler_t::ignore);
 
             res.set_content(result, "application/json");
 
         } else {
-            Whisper whisper(whisperModel, vad_model);
-
-            WhisperJobConfig config = { .lang = lang, .use_vad = true };
-
-            if (!whisper(pcm.samples(), processSampleCount, config)) {
+            // inputs that could not be streamed are transcribed now that they are decoded
+            if (!transcription_started)
+                transcription_result = transcribe(nullptr).exit_code;
+
+            if (WhisperReturnValue r(transcription_result); !r) {
+                if (r.unavailable()) {
+                    log.warn("all whisper states are busy, rejecting request");
+                    res.set_header("Retry-After", "1");
+                    res.status = 503;
+                    return;
+                }
                 cerr << "whisper error" << endl;
                 res.status = 500;
                 return;
             }
 
-            string result = whisper.getResult().to_json().dump(2, ' ', false, json::error_handler_t::ignore);
+            string result = transcriber.getResult().to_json().dump(2, ' ', false, json::error_handler_t::ignore);
             // string result = whisper.segments_to_json().dump(2, ' ', false, json::error_handler_t::ignore);
 
             res.set_content(result, "application/json");
@@ -856,6 +1321,10 @@ void runServer(logger& log, const ServerConfig& config = ServerConfig())
     log.info("running server on port {}", config.port);
 
     server.listen("0.0.0.0", config.port);
+
+    vad_precompute_queue.close();
+    if (vad_precompute_thread.joinable())
+        vad_precompute_thread.join();
 }
 
 std::string resolve_path(fs::path prefix, std::string path) {
@@ -911,15 +1380,60 @@ int main(int argc, char* argv[])
             "whisper DTW model type (tiny.en, base, base.en, small, small.en, medium, medium.en, large.v1, large.v2, large.v3)", config.whisper_dtw, &config.whisper_dtw);
     auto static_option = op.add<Value<fs::path>>("s", "static", "path to static directory", config.static_path, &config.static_path);
     auto limit_whisper_option = op.add<Value<int>>("l", "limit", "limit whisper input duration in seconds", config.limit_whisper_input_s, &config.limit_whisper_input_s);
-    auto vad_option = op.add<Value<fs::path>>("", "vad", "VAD model (Silero VAD onnx)", config.vad_model_path, &config.vad_model_path);
+    auto vad_option = op.add<Value<fs::path>>("", "vad", "VAD model (Silero VAD onnx, or v5 weights converted for the native engine)", config.vad_model_path, &config.vad_model_path);
     auto vad_trim_range_option = op.add<Value<int>>("V", "trim", "VAD trim range in seconds", config.vad_trim_range_s, &config.vad_trim_range_s);
     auto cpu_option = op.add<Implicit<string>>("", "cpu", "CPU only (no MPS/CUDA) for specified engines (whisper or all), if no argument passed, then 'all' is inferred", "all");
     auto gpu_option = op.add<Implicit<string>>("", "gpu", "set GPU device for each engine (default is 0 - first GPU), e.g., whisper:0", "all:0");
     auto device_option = op.add<Value<string>>("d", "device", "set device (CPU/GPU[#X]) for each engine, e.g., whisper:cpu", "all:cpu");
     auto parallel_option = op.add<Value<int>>("P", "parallel", "number of parallel whisper processor instances", config.max_whisper_instances, &config.max_whisper_instances);
+    auto states_option = op.add<Value<int>>("", "states", "max number of whisper states shared by all requests (0 - parallel instances + 1)", config.max_whisper_states, &config.max_whisper_states);
+    auto state_wait_option = op.add<Value<int>>("", "state-wait", "time in ms a synchronous request waits for a free whisper state (-1 - indefinitely, 0 - reject immediately)",
+            config.whisper_state_wait_ms, &config.whisper_state_wait_ms);
     auto no_vad_option = op.add<Switch>("", "no-vad", "disable VAD");
+    auto no_energy_gate_option = op.add<Switch>("", "no-energy-gate", "run VAD model on every window, also on digital silence");
+    auto no_vad_8k_option = op.add<Switch>("", "no-vad-8k", "run VAD of 8 kHz audio on the 16 kHz whisper input");
+    auto energy_floor_option = op.add<Value<float>>("", "energy-floor", "RMS level in dBFS below which VAD windows are silence without running the model",
+            config.vad_energy_floor_db, &config.vad_energy_floor_db);
+    auto vad_batch_option = op.add<Value<int>>("", "vad-batch", "run VAD of concurrent synchronous requests in batches of up to N windows (0 - no batching)",
+            config.vad_batch, &config.vad_batch);
+    auto vad_intra_threads_option = op.add<Value<int>>("", "vad-intra-threads", "ONNX Runtime threads of a single VAD model run",
+            config.vad_intra_threads, &config.vad_intra_threads);
+    auto vad_inter_threads_option = op.add<Value<int>>("", "vad-inter-threads", "ONNX Runtime threads running independent VAD graph nodes",
+            config.vad_inter_threads, &config.vad_inter_threads);
+    auto vad_sessions_option = op.add<Value<int>>("", "vad-sessions", "max concurrent VAD model runs (0 - hardware threads / intra threads)",
+            config.vad_sessions, &config.vad_sessions);
+    auto vad_cache_option = op.add<Value<int>>("", "vad-cache", "speech range lists of recently processed audio kept in memory (0 - always run VAD)",
+            config.vad_cache_entries, &config.vad_cache_entries);
+    auto vad_cache_ttl_option = op.add<Value<int>>("", "vad-cache-ttl", "keep stored speech ranges of audio without a document for N seconds (0 - forever)",
+            config.vad_cache_ttl_s, &config.vad_cache_ttl_s);
+    auto no_vad_precompute_option = op.add<Switch>("", "no-vad-precompute", "do not detect speech in uploaded document audio ahead of transcription");
+    auto vad_threads_option = op.add<Value<int>>("", "vad-threads", "compute VAD of long queued jobs in parallel chunks on N threads", config.vad_threads, &config.vad_threads);
+    auto split_option = op.add<Switch>("", "split", "transcribe speech ranges of a single queued job in parallel on all instances (no text context between ranges)");
+    auto no_pack_option = op.add<Switch>("", "no-pack", "transcribe each VAD speech range separately instead of packing short ranges into one whisper window");
+    auto full_ctx_option = op.add<Switch>("", "full-ctx", "always run whisper encoder on full 30s context (no adaptive audio context for short inputs)");
+    auto job_ttl_option = op.add<Value<int>>("", "job-ttl", "keep results of finished queued jobs in memory and in the database for N seconds each (0 - forever)", config.job_ttl_s, &config.job_ttl_s);
+    auto job_retention_option = op.add<Value<int>>("", "job-retention", "memory budget in MB for results of finished queued jobs (0 - unlimited)",
+            config.job_retention_mb, &config.job_retention_mb);
+    auto no_spill_option = op.add<Switch>("", "no-spill", "do not store evicted job results in the database (evicted jobs are forgotten)");
+    auto schedule_option = op.add<Value<string>>("", "schedule", "queued job scheduling: fifo or sjf (shortest audio first with aging)", config.schedule, &config.schedule);
+    auto aging_option = op.add<Value<double>>("", "aging", "seconds of audio duration forgiven per second of waiting for sjf scheduling", config.schedule_aging, &config.schedule_aging);
+    auto fair_share_option = op.add<Switch>("", "fair-share", "share processors fairly between clients (by client, doc or key request parameter or address)");
+    auto no_preempt_option = op.add<Switch>("", "no-preempt", "do not suspend long running jobs in favour of more urgent ones");
+    auto max_queued_jobs_option = op.add<Value<int>>("", "max-queued-jobs", "max number of waiting queued jobs, more are rejected with 429 (0 - unlimited)",
+            config.max_queued_jobs, &config.max_queued_jobs);
+    auto max_queued_audio_option = op.add<Value<double>>("", "max-queued-audio", "max hours of audio in waiting queued jobs (0 - unlimited)",
+            config.max_queued_audio_h, &config.max_queued_audio_h);
+    auto max_queued_mb_option = op.add<Value<int>>("", "max-queued-mb", "max sample memory in MB of waiting queued jobs (0 - unlimited)",
+            config.max_queued_mb, &config.max_queued_mb);
+    auto queue_resident_option = op.add<Value<int>>("", "queue-resident-mb", "audio of waiting queued jobs kept in memory in MB, more is spilled to files (0 - never spill)",
+            config.queue_resident_mb, &config.queue_resident_mb);
     auto cors_option = op.add<Switch>("", "cors", "add permissive CORS headers");
     auto extract_option = op.add<Value<fs::path>, Attribute::hidden>("", "extract", "extract embedded static data to specified path");
+    auto bench_vad_option = op.add<Value<fs::path>, Attribute::hidden>("", "bench-vad", "benchmark VAD inference on specified wav file");
+    auto validate_vad_option = op.add<Value<fs::path>, Attribute::hidden>("", "validate-vad", "compare parallel VAD against sequential on specified wav file");
+    auto vad_parity_option = op.add<Value<fs::path>, Attribute::hidden>("", "vad-parity", "compare VAD probabilities on specified wav file against --vad-reference");
+    auto vad_reference_option = op.add<Value<fs::path>, Attribute::hidden>("", "vad-reference", "reference VAD probabilities (convert_silero_vad.py --reference)");
+    auto vad_reference_model_option = op.add<Value<fs::path>, Attribute::hidden>("", "vad-reference-model", "reference VAD model run on the same input (e.g. the ONNX model of a native one)");
 
 
     engineDeviceConf.add(Engines::Whisper, 0, "whisper", {"w", "asr"});
@@ -937,6 +1451,15 @@ int main(int argc, char* argv[])
         verbose = verbose_option->is_set();
         config.cpu_only = cpu_option->is_set();
         config.add_cors_headers = cors_option->is_set();
+        config.split_ranges = split_option->is_set();
+        config.pack_ranges = !no_pack_option->is_set();
+        config.spill_job_results = !no_spill_option->is_set();
+        config.fair_share = fair_share_option->is_set();
+        config.preemption = !no_preempt_option->is_set();
+        config.adaptive_audio_ctx = !full_ctx_option->is_set();
+        config.vad_energy_gate = !no_energy_gate_option->is_set();
+        config.vad_8k = !no_vad_8k_option->is_set();
+        config.vad_precompute = !no_vad_precompute_option->is_set();
 
         if(help_option->is_set()) {
             cerr << argv[0] << " [options]" << endl;
@@ -945,6 +1468,11 @@ int main(int argc, char* argv[])
             return 0;
         }
 
+        if (config.schedule != "fifo" && config.schedule != "sjf") {
+            cerr << "unknown scheduling policy: " << config.schedule << endl;
+            return 1;
+        }
+
         if(verbose)
             spdlog::set_level(spdlog::level::debug);
 
@@ -1061,6 +1589,42 @@ int main(int argc, char* argv[])
         return EXIT_FAILURE;
     }
 
+    if (bench_vad_option->is_set() || validate_vad_option->is_set() || vad_parity_option->is_set()) {
+        auto path = bench_vad_option->is_set() ? bench_vad_option->value() :
+            validate_vad_option->is_set() ? validate_vad_option->value() : vad_parity_option->value();
+        std::ifstream file(path, std::ios::binary);
+        string content((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+        // 8 kHz files run through the model's 8 kHz branch, anything else is converted to 16 kHz
+        PCMBuffer pcm(content.data(), content.size(), 0);
+        if (pcm && pcm.sample_rate() != 8000 && pcm.sample_rate() != 16000)
+            pcm.from_wav(content.data(), content.size(), 16000);
+        if (!pcm) {
+            log.error("unable to load wav file {}", path.string());
+            return EXIT_FAILURE;
+        }
+        VADConfig vad_config;
+        // 8 kHz telephony audio runs through the model's 8 kHz branch without resampling
+        vad_config.sample_rate = pcm.sample_rate();
+        vad_config.parallel_threads = config.vad_threads;
+        vad_config.energy_gate = config.vad_energy_gate;
+        vad_config.energy_floor_db = config.vad_energy_floor_db;
+        if (bench_vad_option->is_set()) {
+            bench_vad(config.vad_model_path.string(), pcm.samples(), pcm.count(), vad_config);
+            return 0;
+        }
+        if (vad_parity_option->is_set()) {
+            if (vad_reference_model_option->is_set())
+                return vad_engine_parity(config.vad_model_path.string(), vad_reference_model_option->value().string(),
+                        pcm.samples(), pcm.count(), pcm.sample_rate()) ? 0 : EXIT_FAILURE;
+            if (!vad_reference_option->is_set()) {
+                log.error("--vad-parity requires --vad-reference or --vad-reference-model");
+                return EXIT_FAILURE;
+            }
+            return vad_parity(config.vad_model_path.string(), pcm.samples(), pcm.count(), pcm.sample_rate(), vad_reference_option->value().string()) ? 0 : EXIT_FAILURE;
+        }
+        return validate_vad(config.vad_model_path.string(), pcm.samples(), pcm.count(), vad_config) ? 0 : EXIT_FAILURE;
+    }
+
     runServer(log, config);
 
 #ifdef USE_CUDA
@@ -0,0 +1,140 @@
+#include <cmath>
+#include <algorithm>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define SIMD_SSE2
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#define SIMD_NEON
+#endif
+
+#include "simd_util.hpp"
+
+
+void energy(const float* samples, size_t count, float& rms, float& peak) {
+    size_t i = 0;
+    float sum = 0;
+    float max = 0;
+
+#if defined(SIMD_SSE2)
+    const __m128 sign = _mm_set1_ps(-0.0f);
+    __m128 sum0 = _mm_setzero_ps(), sum1 = _mm_setzero_ps();
+    __m128 max0 = _mm_setzero_ps(), max1 = _mm_setzero_ps();
+    for (; i + 8 <= count; i += 8) {
+        __m128 a = _mm_loadu_ps(samples + i);
+        __m128 b = _mm_loadu_ps(samples + i + 4);
+        sum0 = _mm_add_ps(sum0, _mm_mul_ps(a, a));
+        sum1 = _mm_add_ps(sum1, _mm_mul_ps(b, b));
+        max0 = _mm_max_ps(max0, _mm_andnot_ps(sign, a));
+        max1 = _mm_max_ps(max1, _mm_andnot_ps(sign, b));
+    }
+    float sums[4], maxs[4];
+    _mm_storeu_ps(sums, _mm_add_ps(sum0, sum1));
+    _mm_storeu_ps(maxs, _mm_max_ps(max0, max1));
+    sum = (sums[0] + sums[1]) + (sums[2] + sums[3]);
+    max = std::max(std::max(maxs[0], maxs[1]), std::max(maxs[2], maxs[3]));
+#elif defined(SIMD_NEON)
+    float32x4_t sum0 = vdupq_n_f32(0), sum1 = vdupq_n_f32(0);
+    float32x4_t max0 = vdupq_n_f32(0), max1 = vdupq_n_f32(0);
+    for (; i + 8 <= count; i += 8) {
+        float32x4_t a = vld1q_f32(samples + i);
+        float32x4_t b = vld1q_f32(samples + i + 4);
+        sum0 = vfmaq_f32(sum0, a, a);
+        sum1 = vfmaq_f32(sum1, b, b);
+        max0 = vmaxq_f32(max0, vabsq_f32(a));
+        max1 = vmaxq_f32(max1, vabsq_f32(b));
+    }
+    sum = vaddvq_f32(vaddq_f32(sum0, sum1));
+    max = vmaxvq_f32(vmaxq_f32(max0, max1));
+#endif
+
+    for (; i < count; i++) {
+        sum += samples[i] * samples[i];
+        max = std::max(max, std::abs(samples[i]));
+    }
+
+    rms = count > 0 ? std::sqrt(sum / count) : 0;
+    peak = max;
+}
+
+float dot(const float* a, const float* b, size_t count) {
+    size_t i = 0;
+    float sum = 0;
+
+#if defined(SIMD_SSE2)
+    __m128 sum0 = _mm_setzero_ps(), sum1 = _mm_setzero_ps();
+    for (; i + 8 <= count; i += 8) {
+        sum0 = _mm_add_ps(sum0, _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+        sum1 = _mm_add_ps(sum1, _mm_mul_ps(_mm_loadu_ps(a + i + 4), _mm_loadu_ps(b + i + 4)));
+    }
+    float sums[4];
+    _mm_storeu_ps(sums, _mm_add_ps(sum0, sum1));
+    sum = (sums[0] + sums[1]) + (sums[2] + sums[3]);
+#elif defined(SIMD_NEON)
+    float32x4_t sum0 = vdupq_n_f32(0), sum1 = vdupq_n_f32(0);
+    for (; i + 8 <= count; i += 8) {
+        sum0 = vfmaq_f32(sum0, vld1q_f32(a + i), vld1q_f32(b + i));
+        sum1 = vfmaq_f32(sum1, vld1q_f32(a + i + 4), vld1q_f32(b + i + 4));
+    }
+    sum = vaddvq_f32(vaddq_f32(sum0, sum1));
+#endif
+
+    for (; i < count; i++)
+        sum += a[i] * b[i];
+
+    return sum;
+}
+
+void s16_to_f32(const int16_t* input, float* output, size_t count) {
+    size_t i = 0;
+    const float scale = 1.0f / 32768.0f;
+
+#if defined(SIMD_SSE2)
+    const __m128 s = _mm_set1_ps(scale);
+    for (; i + 8 <= count; i += 8) {
+        __m128i x = _mm_loadu_si128((const __m128i*)(input + i));
+        // sign extend by placing each sample in the upper half of a 32-bit lane
+        __m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(x, x), 16);
+        __m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(x, x), 16);
+        _mm_storeu_ps(output + i, _mm_mul_ps(_mm_cvtepi32_ps(lo), s));
+        _mm_storeu_ps(output + i + 4, _mm_mul_ps(_mm_cvtepi32_ps(hi), s));
+    }
+#elif defined(SIMD_NEON)
+    for (; i + 8 <= count; i += 8) {
+        int16x8_t x = vld1q_s16(input + i);
+        vst1q_f32(output + i, vmulq_n_f32(vcvtq_f32_s32(vmovl_s16(vget_low_s16(x))), scale));
+        vst1q_f32(output + i + 4, vmulq_n_f32(vcvtq_f32_s32(vmovl_s16(vget_high_s16(x))), scale));
+    }
+#endif
+
+    for (; i < count; i++)
+        output[i] = input[i] * scale;
+}
+
+void f32_to_s16(const float* input, int16_t* output, size_t count) {
+    size_t i = 0;
+
+#if defined(SIMD_SSE2)
+    const __m128 s = _mm_set1_ps(32768.0f);
+    for (; i + 8 <= count; i += 8) {
+        // rounds to nearest, the pack saturates
+        __m128i lo = _mm_cvtps_epi32(_mm_mul_ps(_mm_loadu_ps(input + i), s));
+        __m128i hi = _mm_cvtps_epi32(_mm_mul_ps(_mm_loadu_ps(input + i + 4), s));
+        _mm_storeu_si128((__m128i*)(output + i), _mm_packs_epi32(lo, hi));
+    }
+#elif defined(SIMD_NEON)
+    for (; i + 8 <= count; i += 8) {
+        int32x4_t lo = vcvtnq_s32_f32(vmulq_n_f32(vld1q_f32(input + i), 32768.0f));
+        int32x4_t hi = vcvtnq_s32_f32(vmulq_n_f32(vld1q_f32(input + i + 4), 32768.0f));
+        vst1q_s16(output + i, vcombine_s16(vqmovn_s32(lo), vqmovn_s32(hi)));
+    }
+#endif
+
+    for (; i < count; i++)
+        output[i] = (int16_t)std::clamp(std::nearbyint(input[i] * 32768.0f), -32768.0f, 32767.0f);
+}
+
+float db_to_amplitude(float db) {
+    return std::pow(10.0f, db / 20.0f);
+}
@@ -0,0 +1,18 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+
+// root mean square and peak absolute value of samples in a single vectorized pass (SSE2 / NEON, scalar fallback)
+void energy(const float* samples, size_t count, float& rms, float& peak);
+
+// dot product of two float vectors
+float dot(const float* a, const float* b, size_t count);
+
+// 16-bit PCM to float and back (rounded, saturated), scaled by 32768 like dr_wav, so that 16-bit audio round-trips exactly
+void s16_to_f32(const int16_t* input, float* output, size_t count);
+void f32_to_s16(const float* input, int16_t* output, size_t count);
+
+// decibels relative to full scale to linear amplitude
+float db_to_amplitude(float db);
@@ -4,6 +4,14 @@
 #include <tuple>
 #include <filesystem>
 #include <fstream>
+#include <atomic>
+#include <cstdio>
+#include <mutex>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include <sqlite3.h>
 
@@ -35,7 +43,17 @@ class StorageImpl {
     SQLite::Statement selectSharedDocumentWritersStmt;
     SQLite::Statement deleteSharedDocumentWriterStmt;
     SQLite::Statement updateSharedDocumentWriterHintStmt;
+    SQLite::Statement insertJobResultStmt;
+    SQLite::Statement selectJobResultStmt;
+    SQLite::Statement deleteExpiredJobResultsStmt;
+    SQLite::Statement insertVADRangesStmt;
+    SQLite::Statement selectVADRangesStmt;
+    SQLite::Statement deleteVADRangesStmt;
+    SQLite::Statement deleteExpiredVADRangesStmt;
+    // prepared statements are shared by the request, queue and VAD precompute threads; methods call each other, hence recursive
+    std::recursive_mutex statement_mutex;
     fs::path file_storage_path;
+    std::atomic<uint64_t> temp_file_counter = 0;
 
 public:
     StorageImpl(const StorageImpl&) = delete;
@@ -140,6 +158,18 @@ public:
 
             db.exec("CREATE INDEX IF NOT EXISTS shared_document_writers_index_token ON shared_document_writers (document_id, token);");
 
+            // results of finished whisper jobs evicted from memory
+            db.exec("CREATE TABLE IF NOT EXISTS job_results (id TEXT PRIMARY KEY, status TEXT, created TEXT DEFAULT CURRENT_TIMESTAMP, data TEXT);");
+
+            db.exec("CREATE INDEX IF NOT EXISTS job_results_index_created ON job_results (created);");
+
+            // VAD speech ranges keyed by audio content and VAD configuration, document_id is set for stored document audio
+            db.exec("CREATE TABLE IF NOT EXISTS vad_ranges (key TEXT PRIMARY KEY, document_id TEXT, created TEXT DEFAULT CURRENT_TIMESTAMP, data TEXT);");
+
+            db.exec("CREATE INDEX IF NOT EXISTS vad_ranges_index_document_id ON vad_ranges (document_id);");
+
+            db.exec("CREATE INDEX IF NOT EXISTS vad_ranges_index_created ON vad_ranges (created);");
+
             // prepare statements
 
             insertDocumentStmt = db.prepare("INSERT OR REPLACE INTO documents (id, type, key, data) VALUES (?, ?, ?, ?);", true);
@@ -164,6 +194,23 @@ public:
 
             updateSharedDocumentWriterHintStmt = db.prepare("UPDATE shared_document_writers SET hint = ? WHERE document_id = ? AND token = ?;", true);
 
+            insertJobResultStmt = db.prepare("INSERT OR REPLACE INTO job_results (id, status, data) VALUES (?, ?, ?);", true);
+
+            selectJobResultStmt = db.prepare("SELECT status, data FROM job_results WHERE id = ?;", true);
+
+            deleteExpiredJobResultsStmt = db.prepare("DELETE FROM job_results WHERE created < datetime('now', ?);", true);
+
+            // the same audio processed without a document (e.g. a queued job) must not unlink the ranges from their document
+            insertVADRangesStmt = db.prepare("INSERT INTO vad_ranges (key, document_id, data) VALUES (?, ?, ?) ON CONFLICT(key) DO UPDATE SET "
+                    "data = excluded.data, created = CURRENT_TIMESTAMP, document_id = COALESCE(NULLIF(excluded.document_id, ''), vad_ranges.document_id);", true);
+
+            selectVADRangesStmt = db.prepare("SELECT data FROM vad_ranges WHERE key = ?;", true);
+
+            deleteVADRangesStmt = db.prepare("DELETE FROM vad_ranges WHERE document_id = ?;", true);
+
+            // ranges of document audio go with the document
+            deleteExpiredVADRangesStmt = db.prepare("DELETE FROM vad_ranges WHERE coalesce(document_id, '') = '' AND created < datetime('now', ?);", true);
+
         } catch (const SQLite::SyntaxError& ex) {
             log.error("storage error: {} at position {} in SQL: {}", ex.what(), ex.offset, ex.sql);
         } catch (const SQLite::Error& ex) {
@@ -233,6 +280,8 @@ public:
     }
 
     std::optional<bool> update(const std::string& id, const std::string& data, const std::string& accessToken = "") {
+        std::lock_guard<std::recursive_mutex> lock(statement_mutex);
+
 
         log.debug("updating document with id = {}", id);
 
@@ -267,6 +316,8 @@ public:
     }
 
     bool put(const std::string& id, const std::string& data, const std::string& key = "", const std::string& type = "json") {
+        std::lock_guard<std::recursive_mutex> lock(statement_mutex);
+
 
         log.debug("storing document with id = {}", id);
 
@@ -295,6 +346,8 @@ public:
     }
 
     std::optional<std::vector<std::tuple<std::string/*token*/, std::string/*timestamp*/, std::string/*hint*/>>> get_document_writers(const std::string& id, const std::string& ownerKey) {
+        std::lock_guard<std::recursive_mutex> lock(statement_mutex);
+
 
         if (auto r = get_document_owner_key(id); r) {
             auto ownerKey = r.value();
@@ -326,6 +379,8 @@ public:
     }
 
     std::optional<bool> remove_document_writer(const std::string& id, const std::string& token, const std::string& ownerKey) {
+        std::lock_guard<std::recursive_mutex> lock(statement_mutex);
+
 
         if (auto r = get_document_owner_key(id); r) {
             if (ownerKey != r.value()) {
@@ -352,6 +407,8 @@ public:
     }
 
     std::optional<bool> update_document_writer_hint(const std::string& id, const std::string& token, const std::string& ownerKey, const std::string& hint) {
+        std::lock_guard<std::recursive_mutex> lock(statement_mutex);
+
 
         if (auto r = get_document_owner_key(id); r) {
             if (ownerKey != r.value()) {
@@ -379,6 +436,8 @@ public:
 
     // NOTE: because this will be called not only by the owner
     std::optional<bool> add_writer_key(const std::string& id, const std::string& accessToken, const std::string& key, const std::string& hint = "") {
+        std::lock_guard<std::recursive_mutex> lock(statement_mutex);
+
         // access_token = get_token(id, owner_key)
 
         // 1. get document owner
@@ -418,6 +477,8 @@ public:
     }
 
     std::optional<bool> check_writer_key(const std::string& id, const std::string& key) {
+        std::lock_guard<std::recursive_mutex> lock(statement_mutex);
+
         log.debug("checking writer key for item with id = {}", id);
 
         auto token = get_token(id, key);
@@ -461,6 +522,8 @@ public:
     }
 
     std::optional<std::pair<std::string, std::string>> get(const std::string& id) {
+        std::lock_guard<std::recursive_mutex> lock(statement_mutex);
+
         log.debug("getting document with id = {}", id);
 
         std::string type, data;
@@ -489,7 +552,171 @@ public:
         return std::make_pair(type, data);
     }
 
+    bool put_job_result(const std::string& id, const std::string& status, const std::string& data) {
+        std::lock_guard<std::recursive_mutex> lock(statement_mutex);
+
+
+        log.debug("storing job result with id = {}", id);
+
+        try {
+            auto& stmt = insertJobResultStmt;
+
+            stmt.reuse();
+
+            stmt.bindAll(id, status, data);
+
+            stmt.exec();
+
+            return true;
+
+        } catch (const std::exception& e) {
+            log.error("storage error: error storing job result: {}", e.what());
+        }
+
+        return false;
+    }
+
+    std::optional<std::pair<std::string, std::string>> get_job_result(const std::string& id) {
+        std::lock_guard<std::recursive_mutex> lock(statement_mutex);
+
+        log.debug("getting job result with id = {}", id);
+
+        std::string status, data;
+
+        try {
+            auto& stmt = selectJobResultStmt;
+
+            stmt.reuse();
+
+            stmt.bindAll(id);
+
+            if (stmt.step()) {
+                status = static_cast<std::string>(stmt["status"]);
+                data = static_cast<std::string>(stmt["data"]);
+            } else {
+                return std::nullopt;
+            }
+
+        } catch (const std::exception& e) {
+            log.error("error retrieving job result with id {}: {}", id, e.what());
+            return std::nullopt;
+        } catch (...) {
+            return std::nullopt;
+        }
+
+        return std::make_pair(status, data);
+    }
+
+    bool remove_expired_job_results(int ttl_s) {
+        std::lock_guard<std::recursive_mutex> lock(statement_mutex);
+
+        try {
+            auto& stmt = deleteExpiredJobResultsStmt;
+
+            stmt.reuse();
+
+            stmt.bindAll("-" + std::to_string(ttl_s) + " seconds");
+
+            stmt.exec();
+
+            return true;
+
+        } catch (const std::exception& e) {
+            log.error("storage error: error removing expired job results: {}", e.what());
+        }
+
+        return false;
+    }
+
+    bool put_vad_ranges(const std::string& key, const std::string& document_id, const std::string& data) {
+        std::lock_guard<std::recursive_mutex> lock(statement_mutex);
+
+        try {
+            auto& stmt = insertVADRangesStmt;
+
+            stmt.reuse();
+
+            stmt.bindAll(key, document_id, data);
+
+            stmt.exec();
+
+            return true;
+
+        } catch (const std::exception& e) {
+            log.error("storage error: error storing VAD ranges: {}", e.what());
+        }
+
+        return false;
+    }
+
+    std::optional<std::string> get_vad_ranges(const std::string& key) {
+        std::lock_guard<std::recursive_mutex> lock(statement_mutex);
+
+        try {
+            auto& stmt = selectVADRangesStmt;
+
+            stmt.reuse();
+
+            stmt.bindAll(key);
+
+            if (stmt.step())
+                return static_cast<std::string>(stmt["data"]);
+
+        } catch (const std::exception& e) {
+            log.error("error retrieving VAD ranges: {}", e.what());
+        } catch (...) {
+        }
+
+        return std::nullopt;
+    }
+
+    bool remove_expired_vad_ranges(int ttl_s) {
+        std::lock_guard<std::recursive_mutex> lock(statement_mutex);
+
+        try {
+            auto& stmt = deleteExpiredVADRangesStmt;
+
+            stmt.reuse();
+
+            stmt.bindAll("-" + std::to_string(ttl_s) + " seconds");
+
+            stmt.exec();
+
+            return true;
+
+        } catch (const std::exception& e) {
+            log.error("storage error: error removing expired VAD ranges: {}", e.what());
+        }
+
+        return false;
+    }
+
+    bool remove_vad_ranges(const std::string& document_id) {
+        std::lock_guard<std::recursive_mutex> lock(statement_mutex);
+
+        log.debug("removing VAD ranges of document with id = {}", document_id);
+
+        try {
+            auto& stmt = deleteVADRangesStmt;
+
+            stmt.reuse();
+
+            stmt.bindAll(document_id);
+
+            stmt.exec();
+
+            return true;
+
+        } catch (const std::exception& e) {
+            log.error("storage error: error removing VAD ranges: {}", e.what());
+        }
+
+        return false;
+    }
+
     std::optional<bool> remove(const std::string& id, const std::string& key) {
+        std::lock_guard<std::recursive_mutex> lock(statement_mutex);
+
         log.debug("removing document with id = {}", id);
 
         try {
@@ -502,6 +729,8 @@ public:
             if (auto r = stmt.step(); !r)
                 return false;
 
+            remove_vad_ranges(id);
+
             return remove_files(id);
 
         } catch (const std::exception& e) {
@@ -518,14 +747,33 @@ public:
 
         std::string path = file_storage_path / (id + extension);
 
-        std::ofstream file(path, std::ios::binary);
-        if (!file) {
-            log.error("filed to open file: {}", path);
+        // the file may be mapped for a download, so it is replaced instead of truncated in place
+        std::string temp_path = path + ".tmp" + std::to_string(temp_file_counter++);
+
+        {
+            std::ofstream file(temp_path, std::ios::binary);
+            if (!file) {
+                log.error("filed to open file: {}", temp_path);
+                return false;
+            }
+
+            file.write(reinterpret_cast<const char*>(data), size);
+            file.close();
+
+            if (!file) {
+                log.error("error writing file: {}", temp_path);
+                std::remove(temp_path.c_str());
+                return false;
+            }
+        }
+
+        if (std::rename(temp_path.c_str(), path.c_str()) != 0) {
+            log.error("failed to replace file: {}", path);
+            std::remove(temp_path.c_str());
             return false;
         }
 
-        file.write(reinterpret_cast<const char*>(data), size);
-        return file.good();
+        return true;
     }
 
     std::optional<SharedBuffer<void>> get_file(const std::string& id, const std::string& extension = ".wav") {
@@ -562,6 +810,61 @@ public:
 
     }
 
+    // the file is mapped instead of read, so that serving it takes no memory beyond the page cache
+    std::optional<MappedFile> map_file(const std::string& id, const std::string& extension) {
+        if (file_storage_path.empty())
+            return std::nullopt;
+
+        std::string path = file_storage_path / (id + extension);
+
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+            return std::nullopt;
+
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+            log.error("error reading file status: {}", path);
+            ::close(fd);
+            return std::nullopt;
+        }
+
+        MappedFile file;
+        file.size = (size_t)st.st_size;
+#ifdef __APPLE__
+        file.modified_s = st.st_mtimespec.tv_sec;
+        file.modified_ns = st.st_mtimespec.tv_nsec;
+#else
+        file.modified_s = st.st_mtim.tv_sec;
+        file.modified_ns = st.st_mtim.tv_nsec;
+#endif
+
+        if (file.size > 0) {
+            void* data = mmap(nullptr, file.size, PROT_READ, MAP_SHARED, fd, 0);
+            if (data == MAP_FAILED) {
+                log.error("failed to map file: {}", path);
+                ::close(fd);
+                return std::nullopt;
+            }
+            madvise(data, file.size, MADV_SEQUENTIAL);
+            size_t size = file.size;
+            file.data = std::shared_ptr<const void>(data, [size](const void* data) { munmap((void*)data, size); });
+        }
+
+        ::close(fd);
+
+        return file;
+    }
+
+    std::string file_path() const { return file_storage_path.string(); }
+
+    bool has_file(const std::string& id, const std::string& extension) {
+        if (file_storage_path.empty())
+            return false;
+
+        std::error_code ec;
+        return fs::is_regular_file(file_storage_path / (id + extension), ec);
+    }
+
     bool remove_file(const std::string& id, const std::string& extension = ".wav") {
         if (file_storage_path.empty())
             return false;
@@ -615,6 +918,8 @@ public:
 
 private:
     std::optional<std::string> get_document_owner_key(const std::string& id) {
+        std::lock_guard<std::recursive_mutex> lock(statement_mutex);
+
 
         try {
             auto& stmt = selectDocumentKeyStmt;
@@ -654,6 +959,10 @@ std::optional<SharedBuffer<void>> Storage::get_file(const std::string& id, const
     return impl->get_file(id, extension);
 }
 
+std::optional<MappedFile> Storage::map_file(const std::string& id, const std::string& extension) {
+    return impl->map_file(id, extension);
+}
+
 bool Storage::remove_file(const std::string& id, const std::string& extension) {
     return impl->remove_file(id, extension);
 }
@@ -666,6 +975,42 @@ std::optional<std::pair<std::string, std::string>> Storage::get(const std::strin
     return impl->get(id);
 }
 
+bool Storage::put_job_result(const std::string& id, const std::string& status, const std::string& data) {
+    return impl->put_job_result(id, status, data);
+}
+
+std::optional<std::pair<std::string, std::string>> Storage::get_job_result(const std::string& id) {
+    return impl->get_job_result(id);
+}
+
+bool Storage::remove_expired_job_results(int ttl_s) {
+    return impl->remove_expired_job_results(ttl_s);
+}
+
+std::string Storage::file_path() const {
+    return impl->file_path();
+}
+
+bool Storage::has_file(const std::string& id, const std::string& extension) {
+    return impl->has_file(id, extension);
+}
+
+bool Storage::put_vad_ranges(const std::string& key, const std::string& document_id, const std::string& data) {
+    return impl->put_vad_ranges(key, document_id, data);
+}
+
+std::optional<std::string> Storage::get_vad_ranges(const std::string& key) {
+    return impl->get_vad_ranges(key);
+}
+
+bool Storage::remove_expired_vad_ranges(int ttl_s) {
+    return impl->remove_expired_vad_ranges(ttl_s);
+}
+
+bool Storage::remove_vad_ranges(const std::string& document_id) {
+    return impl->remove_vad_ranges(document_id);
+}
+
 std::optional<bool> Storage::remove(const std::string& id, const std::string& key) {
     return impl->remove(id, key);
 }
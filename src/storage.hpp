@@ -4,11 +4,19 @@
 #include <optional>
 #include <memory>
 #include <utility>
+#include <cstdint>
 
 #include "util.hpp"
 
 class StorageImpl;
 
+struct MappedFile {
+    std::shared_ptr<const void> data;   // unmapped with the last reference
+    size_t size = 0;
+    int64_t modified_s = 0;     // modification time (unix)
+    int64_t modified_ns = 0;
+};
+
 class Storage {
 public:
     Storage(const std::string& path, const std::string& file_storage_path = "files");
@@ -26,11 +34,28 @@ public:
 
     bool put_file(const std::string& id, const void* data, size_t size, const std::string& extension = ".wav");
     std::optional<SharedBuffer<void>> get_file(const std::string& id, const std::string& extension = ".wav");
+    std::optional<MappedFile> map_file(const std::string& id, const std::string& extension = ".wav");
+    bool has_file(const std::string& id, const std::string& extension);
+    // directory of the stored files, empty if unusable
+    std::string file_path() const;
     bool remove_file(const std::string& id, const std::string& extension = ".wav");
     bool remove_files(const std::string& id);
 
     std::optional<bool> update(const std::string& id, const std::string& data, const std::string& accessToken = "");
 
+    // results of finished whisper jobs evicted from memory: status and jsonl segments
+    bool put_job_result(const std::string& id, const std::string& status, const std::string& data);
+    std::optional<std::pair<std::string, std::string>> get_job_result(const std::string& id);
+    // drop job results stored more than ttl_s seconds ago
+    bool remove_expired_job_results(int ttl_s);
+
+    // VAD speech ranges of audio (see VAD::cache_key), document_id links them to stored document audio
+    bool put_vad_ranges(const std::string& key, const std::string& document_id, const std::string& data);
+    std::optional<std::string> get_vad_ranges(const std::string& key);
+    bool remove_vad_ranges(const std::string& document_id);
+    // drop ranges of audio without a document stored more than ttl_s seconds ago
+    bool remove_expired_vad_ranges(int ttl_s);
+
     std::optional<bool> remove(const std::string& id, const std::string& key);
     std::optional<bool> check_key(const std::string& id, const std::string& key);
     std::optional<bool> check_owner_key(const std::string& id, const std::string& key);
@@ -14,6 +14,7 @@ public:
     template <typename Deleter>
     SharedBuffer(T* ptr, Deleter d, size_t size) : ptr_manager(ptr, d), _data(ptr), _size(size) {}
     SharedBuffer(SharedBuffer&& other) : ptr_manager(std::move(other.ptr_manager)), _data(other._data), _size(other._size), size(_size), count(_size), data(_data) {}
+    SharedBuffer& operator=(SharedBuffer&& other) { ptr_manager = std::move(other.ptr_manager); _data = other._data; _size = other._size; return *this; }
     bool empty() const { return data == nullptr || size == 0; }
     void free() { if (ptr_manager) ptr_manager.reset(); _data = nullptr; _size = 0; }
     const size_t& size = _size;
@@ -0,0 +1,209 @@
+#include <fstream>
+#include <map>
+#include <cmath>
+#include <cstring>
+#include <cstdint>
+#include <algorithm>
+
+#include "silero_native.hpp"
+#include "../simd_util.hpp"
+
+
+// file layout: magic, version, tensor count, then per tensor: name length, name, number of dims, dims, float32 data
+static const char native_magic[4] = { 'S', 'L', 'R', 'V' };
+static const uint32_t native_version = 1;
+
+
+void SileroNativeModel::State::reset() {
+    std::memset(h, 0, sizeof(h));
+    std::memset(c, 0, sizeof(c));
+    std::memset(context, 0, sizeof(context));
+}
+
+bool SileroNativeModel::is_native(const std::string& path) {
+    std::ifstream file(path, std::ios::binary);
+    char magic[4] = {};
+    return file.read(magic, sizeof(magic)) && std::memcmp(magic, native_magic, sizeof(magic)) == 0;
+}
+
+bool SileroNativeModel::load(const std::string& path) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file) {
+        what = "unable to open " + path;
+        return false;
+    }
+
+    char magic[4] = {};
+    uint32_t version = 0, count = 0;
+    file.read(magic, sizeof(magic));
+    file.read((char*)&version, sizeof(version));
+    file.read((char*)&count, sizeof(count));
+    if (!file || std::memcmp(magic, native_magic, sizeof(magic)) != 0 || version != native_version) {
+        what = "not a native Silero VAD model: " + path;
+        return false;
+    }
+
+    std::map<std::string, std::pair<std::vector<uint32_t>, std::vector<float>>> tensors;
+    for (uint32_t t = 0; t < count; t++) {
+        uint32_t length = 0, ndims = 0;
+        file.read((char*)&length, sizeof(length));
+        std::string name(length, '\0');
+        file.read(name.data(), length);
+        file.read((char*)&ndims, sizeof(ndims));
+        std::vector<uint32_t> dims(ndims);
+        file.read((char*)dims.data(), ndims * sizeof(uint32_t));
+        size_t size = 1;
+        for (auto d : dims)
+            size *= d;
+        std::vector<float> data(size);
+        file.read((char*)data.data(), size * sizeof(float));
+        if (!file) {
+            what = "truncated native Silero VAD model: " + path;
+            return false;
+        }
+        tensors[name] = { std::move(dims), std::move(data) };
+    }
+
+    // takes a tensor of the expected size
+    const auto take = [&](const std::string& name, size_t size, std::vector<float>& out) {
+        auto it = tensors.find(name);
+        if (it == tensors.end() || it->second.second.size() != size) {
+            what = "missing or invalid tensor " + name + " in " + path;
+            return false;
+        }
+        out = std::move(it->second.second);
+        return true;
+    };
+
+    // 16 kHz tensors have no prefix, the optional 8 kHz branch is prefixed with "8k."
+    const auto load_branch = [&](Branch& b, const std::string& prefix, int window, int context, int fft) {
+        b.window = window;
+        b.context = context;
+        b.fft = fft;
+        b.hop = fft / 2;
+        b.bins = fft / 2 + 1;
+
+        if (!take(prefix + "stft.forward_basis_buffer", 2 * b.bins * b.fft, b.stft_basis))
+            return false;
+
+        const int channels[5] = { b.bins, 128, 64, 64, 128 };
+        const int strides[4] = { 1, 2, 2, 1 };
+        for (int i = 0; i < 4; i++) {
+            auto& conv = b.encoder[i];
+            conv.in = channels[i];
+            conv.out = channels[i + 1];
+            conv.stride = strides[i];
+            std::string name = prefix + "encoder." + std::to_string(i) + ".reparam_conv.";
+            if (!take(name + "weight", conv.out * conv.in * 3, conv.weight) || !take(name + "bias", conv.out, conv.bias))
+                return false;
+        }
+
+        std::vector<float> bias_ih, bias_hh;
+        if (!take(prefix + "decoder.rnn.weight_ih", 4 * hidden * hidden, b.lstm_ih) || !take(prefix + "decoder.rnn.weight_hh", 4 * hidden * hidden, b.lstm_hh)
+                || !take(prefix + "decoder.rnn.bias_ih", 4 * hidden, bias_ih) || !take(prefix + "decoder.rnn.bias_hh", 4 * hidden, bias_hh))
+            return false;
+        b.lstm_bias.resize(4 * hidden);
+        for (int i = 0; i < 4 * hidden; i++)
+            b.lstm_bias[i] = bias_ih[i] + bias_hh[i];
+
+        std::vector<float> bias;
+        if (!take(prefix + "decoder.decoder.2.weight", hidden, b.decoder_weight) || !take(prefix + "decoder.decoder.2.bias", 1, bias))
+            return false;
+        b.decoder_bias = bias[0];
+        b.loaded = true;
+        return true;
+    };
+
+    if (!load_branch(branch_16k, "", 512, 64, 256))
+        return false;
+    if (tensors.count("8k.stft.forward_basis_buffer") && !load_branch(branch_8k, "8k.", 256, 32, 128))
+        return false;
+
+    return true;
+}
+
+const SileroNativeModel::Branch* SileroNativeModel::branch(int sample_rate) const {
+    if (sample_rate == 16000 && branch_16k.loaded)
+        return &branch_16k;
+    if (sample_rate == 8000 && branch_8k.loaded)
+        return &branch_8k;
+    return nullptr;
+}
+
+// kernel 3, padding 1, followed by ReLU, activations are [channels][frames]
+void SileroNativeModel::conv_relu(const Conv& conv, const float* in, int frames_in, float* out, int& frames_out) {
+    frames_out = (frames_in + 2 - 3) / conv.stride + 1;
+    const int width = conv.in * 3;
+    float col[129 * 3];
+    for (int t = 0; t < frames_out; t++) {
+        // the input patch of output frame t in the weight layout: col[i * 3 + k] = in[i][t * stride + k - 1]
+        for (int i = 0; i < conv.in; i++) {
+            for (int k = 0; k < 3; k++) {
+                int s = t * conv.stride + k - 1;
+                col[i * 3 + k] = s >= 0 && s < frames_in ? in[i * frames_in + s] : 0;
+            }
+        }
+        for (int o = 0; o < conv.out; o++)
+            out[o * frames_out + t] = std::max(0.0f, conv.bias[o] + dot(&conv.weight[o * width], col, width));
+    }
+}
+
+static inline float sigmoid(float x) { return 1.0f / (1.0f + std::exp(-x)); }
+
+float SileroNativeModel::infer(const float* samples, State& state, int sample_rate) const {
+    auto bp = branch(sample_rate);
+    if (!bp)
+        return 0;
+    auto& b = *bp;
+
+    // context of the previous window, the window and reflection padding on the right
+    constexpr int max_padded = 2 * max_context + 512;
+    const int input_size = b.context + b.window;
+    const int padded_size = input_size + b.context;
+    const int frames = (padded_size - b.fft) / b.hop + 1;    // 4 at both sample rates
+    float padded[max_padded];
+    std::memcpy(padded, state.context, b.context * sizeof(float));
+    std::memcpy(padded + b.context, samples, b.window * sizeof(float));
+    for (int j = 0; j < b.context; j++)
+        padded[input_size + j] = padded[input_size - 2 - j];
+    std::memcpy(state.context, padded + input_size - b.context, b.context * sizeof(float));
+
+    // STFT magnitude, [bins][frames]
+    constexpr int max_frames = 4;
+    float features[129 * max_frames];
+    for (int t = 0; t < frames; t++) {
+        const float* frame = padded + t * b.hop;
+        for (int f = 0; f < b.bins; f++) {
+            float re = dot(&b.stft_basis[f * b.fft], frame, b.fft);
+            float im = dot(&b.stft_basis[(f + b.bins) * b.fft], frame, b.fft);
+            features[f * frames + t] = std::sqrt(re * re + im * im);
+        }
+    }
+
+    // encoder: 4 frames -> 4 -> 2 -> 1 -> 1
+    float x[128 * max_frames], y[128 * max_frames];
+    int n = frames;
+    conv_relu(b.encoder[0], features, n, x, n);
+    conv_relu(b.encoder[1], x, n, y, n);
+    conv_relu(b.encoder[2], y, n, x, n);
+    conv_relu(b.encoder[3], x, n, y, n);
+
+    // LSTM cell over the single remaining frame
+    float gates[4 * hidden];
+    for (int g = 0; g < 4 * hidden; g++)
+        gates[g] = b.lstm_bias[g] + dot(&b.lstm_ih[g * hidden], y, hidden) + dot(&b.lstm_hh[g * hidden], state.h, hidden);
+    for (int i = 0; i < hidden; i++) {
+        float ig = sigmoid(gates[i]);
+        float fg = sigmoid(gates[hidden + i]);
+        float gg = std::tanh(gates[2 * hidden + i]);
+        float og = sigmoid(gates[3 * hidden + i]);
+        state.c[i] = fg * state.c[i] + ig * gg;
+        state.h[i] = og * std::tanh(state.c[i]);
+    }
+
+    // decoder: ReLU, 1x1 conv, sigmoid
+    float relu_h[hidden];
+    for (int i = 0; i < hidden; i++)
+        relu_h[i] = std::max(0.0f, state.h[i]);
+    return sigmoid(b.decoder_bias + dot(b.decoder_weight.data(), relu_h, hidden));
+}
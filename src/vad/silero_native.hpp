@@ -0,0 +1,69 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+
+// Silero VAD v5 network (16 and 8 kHz) without ONNX Runtime: STFT, four conv blocks, LSTM cell and decoder.
+// Weights are converted from the PyTorch model with convert_silero_vad.py.
+class SileroNativeModel {
+public:
+    static constexpr int hidden = 128;      // LSTM state size
+    static constexpr int max_context = 64;
+
+    // per stream recurrent state
+    struct State {
+        float h[hidden];
+        float c[hidden];
+        float context[max_context];
+        State() { reset(); }
+        void reset();
+    };
+
+    // false on error, see error()
+    bool load(const std::string& path);
+    const std::string& error() const { return what; }
+
+    // does the file look like converted native weights
+    static bool is_native(const std::string& path);
+
+    bool supports(int sample_rate) const { return branch(sample_rate) != nullptr; }
+    // samples per window: 512 at 16 kHz, 256 at 8 kHz
+    static int window(int sample_rate) { return sample_rate == 8000 ? 256 : 512; }
+
+    // speech probability of one window, safe to call concurrently with different states
+    float infer(const float* samples, State& state, int sample_rate = 16000) const;
+
+private:
+    struct Conv {
+        std::vector<float> weight;  // [out][in][kernel]
+        std::vector<float> bias;    // [out]
+        int in = 0;
+        int out = 0;
+        int stride = 1;
+    };
+
+    // weights and geometry of one sample rate
+    struct Branch {
+        bool loaded = false;
+        int window = 0;
+        int context = 0;                    // samples of the previous window prepended to each window
+        int fft = 0;                        // STFT filter length
+        int hop = 0;
+        int bins = 0;
+        std::vector<float> stft_basis;      // [2 * bins][fft], real then imaginary parts
+        Conv encoder[4];
+        std::vector<float> lstm_ih;         // [4 * hidden][hidden], gates i, f, g, o
+        std::vector<float> lstm_hh;         // [4 * hidden][hidden]
+        std::vector<float> lstm_bias;       // [4 * hidden], both biases summed
+        std::vector<float> decoder_weight;  // [hidden]
+        float decoder_bias = 0;
+    };
+
+    const Branch* branch(int sample_rate) const;
+    static void conv_relu(const Conv& conv, const float* in, int frames_in, float* out, int& frames_out);
+
+    Branch branch_16k;
+    Branch branch_8k;
+    std::string what;
+};
@@ -7,9 +7,19 @@
 #include <memory>
 #include <string>
 #include <stdexcept>
+#include <exception>
 #include <iostream>
 #include <string>
 #include <functional>
+#include <algorithm>
+#include <cmath>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include <fstream>
+#include <list>
+#include <unordered_map>
 
 #include <cstdio>
 #include <cstdarg>
@@ -17,9 +27,14 @@
 #include <memory>
 #endif
 
+#ifdef USE_ONNX_VAD
 #include <onnxruntime/core/session/onnxruntime_cxx_api.h>
+#endif
 
 #include "vad.hpp"
+#include "../log.hpp"
+#include "silero_native.hpp"
+#include "../simd_util.hpp"
 
 
 class timestamp_t
@@ -93,50 +108,680 @@ private:
 };
 
 
-class VADModelImpl {
+class VADBatcher;
+
+#ifdef USE_ONNX_VAD
+// one environment (logging, default thread pools) for all VAD models of the process
+static Ort::Env& ort_env()
+{
+    static Ort::Env env(ORT_LOGGING_LEVEL_WARNING, "vad");
+    return env;
+}
+
+// Bounded pool of sessions over one model. A stream leases a free session for all of its windows (a batch for one run),
+// so at most size() leases with up to intra_threads threads each run at once and further ones wait. Sessions are
+// created on first demand, outside of the pool lock.
+class VADSessionPool
+{
+    struct Slot;
+
 public:
-    VADModelImpl(const std::string& model_path) {
-        init_onnx_model(model_path);
+    // a session checked out of the pool, returned on destruction
+    class Lease {
+    public:
+        Lease(VADSessionPool* pool, Slot* slot, std::chrono::steady_clock::time_point t0)
+            : pool(pool), slot(slot), t0(t0), t1(std::chrono::steady_clock::now()) {}
+        Lease(const Lease&) = delete;
+        Lease& operator=(const Lease&) = delete;
+        ~Lease() { pool->release(slot, t0, t1); }
+
+        Ort::Session& session() { return *slot->session; }
+
+    private:
+        VADSessionPool* pool;
+        Slot* slot;
+        std::chrono::steady_clock::time_point t0, t1;
+    };
+
+    VADSessionPool(const std::string& model_path, const VADEngineConfig& engine) : model_path(model_path)
+    {
+        options.SetIntraOpNumThreads(std::max(1, engine.intra_threads));
+        options.SetInterOpNumThreads(std::max(1, engine.inter_threads));
+        options.SetGraphOptimizationLevel(GraphOptimizationLevel::ORT_ENABLE_ALL);
+        max_sessions = engine.sessions > 0 ? engine.sessions :
+            std::max(1, (int)std::thread::hardware_concurrency() / std::max(1, engine.intra_threads));
+        // the first session also serves the model metadata
+        add();
     }
-private:
-    void init_engine_threads(int inter_threads, int intra_threads)
+
+    Ort::Session& first() { return *slots[0]->session; }
+    size_t size() const { return max_sessions; }
+
+    // waits for a session no other stream is using
+    std::unique_ptr<Lease> lease()
+    {
+        auto t0 = std::chrono::steady_clock::now();
+        std::unique_lock<std::mutex> lock(mutex);
+        if (free_slots.empty() && slots.size() + creating < max_sessions) {
+            // loading the model takes a while, other leases go on meanwhile
+            creating++;
+            lock.unlock();
+            std::unique_ptr<Slot> slot;
+            try {
+                slot = create();
+            } catch (...) {
+                lock.lock();
+                creating--;
+                throw;
+            }
+            lock.lock();
+            creating--;
+            slots.push_back(std::move(slot));
+            return std::make_unique<Lease>(this, slots.back().get(), t0);
+        }
+        cv.wait(lock, [&] { return !free_slots.empty(); });
+        Slot* slot = free_slots.back();
+        free_slots.pop_back();
+        return std::make_unique<Lease>(this, slot, t0);
+    }
+
+    // calls f(session) with a session leased for this call only
+    template <class F>
+    void run(F&& f)
+    {
+        auto lease = this->lease();
+        f(lease->session());
+    }
+
+    std::vector<VADSessionStats> stats()
     {
-        // The method should be called in each thread/proc in multi-thread/proc work
-        session_options.SetIntraOpNumThreads(intra_threads);
-        session_options.SetInterOpNumThreads(inter_threads);
-        session_options.SetGraphOptimizationLevel(GraphOptimizationLevel::ORT_ENABLE_ALL);
+        std::lock_guard<std::mutex> lock(mutex);
+        std::vector<VADSessionStats> result;
+        for (auto& slot : slots)
+            result.push_back(slot->stats);
+        return result;
+    }
+
+private:
+    struct Slot {
+        std::unique_ptr<Ort::Session> session;
+        VADSessionStats stats;
     };
 
-    void init_onnx_model(const std::string& model_path)
+    std::unique_ptr<Slot> create()
+    {
+        auto slot = std::make_unique<Slot>();
+        slot->session = std::make_unique<Ort::Session>(ort_env(), model_path.c_str(), options);
+        return slot;
+    }
+
+    // from the constructor
+    void add()
+    {
+        slots.push_back(create());
+        free_slots.push_back(slots.back().get());
+    }
+
+    void release(Slot* slot, std::chrono::steady_clock::time_point t0, std::chrono::steady_clock::time_point t1)
     {
-        // Init threads = 1 for 
-        init_engine_threads(1, 1);
-        // Load model
-        session = std::make_shared<Ort::Session>(env, model_path.c_str(), session_options);
+        auto t2 = std::chrono::steady_clock::now();
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            slot->stats.runs++;
+            slot->stats.wait_s += std::chrono::duration<double>(t1 - t0).count();
+            slot->stats.busy_s += std::chrono::duration<double>(t2 - t1).count();
+            free_slots.push_back(slot);
+        }
+        cv.notify_one();
+    }
+
+    std::string model_path;
+    Ort::SessionOptions options;
+    size_t max_sessions = 1;
+    size_t creating = 0;    // sessions being created outside of the lock
+    std::vector<std::unique_ptr<Slot>> slots;
+    std::vector<Slot*> free_slots;
+    std::mutex mutex;
+    std::condition_variable cv;
+};
+#endif
+
+// energy pre-gate: windows below the floor are silence without running the model
+struct VADGate {
+    float rms_floor = 0;    // 0 - disabled
+    float peak_floor = 0;
+    std::atomic<size_t>* windows = nullptr;
+    std::atomic<size_t>* skipped = nullptr;
+};
+
+class VADModelImpl {
+public:
+    VADModelImpl(const std::string& model_path, const VADEngineConfig& engine = VADEngineConfig()) : name(model_path.substr(model_path.find_last_of("/\\") + 1)) {
+        if (SileroNativeModel::is_native(model_path)) {
+            native = std::make_unique<SileroNativeModel>();
+            if (!native->load(model_path))
+                throw std::runtime_error(native->error());
+            return;
+        }
+#ifdef USE_ONNX_VAD
+        init_onnx_model(model_path, engine);
+#else
+        throw std::runtime_error("built without ONNX Runtime, convert the VAD model with convert_silero_vad.py: " + model_path);
+#endif
+    }
+
+    // samples per window fixed by the model (0 - set by VADConfig::windows_frame_size_ms)
+    int64_t window_size(int sample_rate) const
+    {
+        if (native)
+            return SileroNativeModel::window(sample_rate);
+        // v5 takes 512 samples at 16 kHz and 256 at 8 kHz, v4 any multiple of 32 ms
+        return version >= 5 ? (sample_rate == 8000 ? 256 : 512) : 0;
+    }
+
+    // samples of the previous window the v5 model expects in front of each window
+    int64_t context_size(int sample_rate) const { return version >= 5 && !native ? (sample_rate == 8000 ? 32 : 64) : 0; }
+
+    bool supports(int sample_rate) const
+    {
+        if (native)
+            return native->supports(sample_rate);
+        return sample_rate == 16000 || sample_rate == 8000;
+    }
+
+private:
+#ifdef USE_ONNX_VAD
+    void init_onnx_model(const std::string& model_path, const VADEngineConfig& engine)
+    {
+        sessions = std::make_shared<VADSessionPool>(model_path, engine);
+
+        // v4 carries separate h and c inputs, v5 a single combined state
+        auto& session = sessions->first();
+        Ort::AllocatorWithDefaultOptions allocator;
+        for (size_t i = 0; i < session.GetInputCount(); i++)
+            if (std::string(session.GetInputNameAllocated(i, allocator).get()) == "state")
+                version = 5;
     };
+#endif
 
     friend class VADImpl;
+    friend class VADInference;
+    friend class VADModel;
+    friend class VAD;
+    friend void bench_vad(const std::string& path, const float* samples, size_t count, VADConfig config);
+    friend bool vad_engine_parity(const std::string& path, const std::string& other_path, const float* samples, size_t count, int sample_rate, float tolerance);
+#ifdef USE_ONNX_VAD
     // OnnxRuntime resources
-    Ort::Env env;
-    Ort::SessionOptions session_options;
-    std::shared_ptr<Ort::Session> session = nullptr;
+    std::shared_ptr<VADSessionPool> sessions;
+    std::shared_ptr<VADBatcher> batcher;
+#endif
+    std::unique_ptr<SileroNativeModel> native;  // built-in engine, no ONNX Runtime
+    int version = 4;                            // Silero generation of the ONNX model
+    std::string name;                           // model file name, part of the range cache keys
+    std::atomic<size_t> gate_windows = 0;
+    std::atomic<size_t> gate_skipped = 0;
 };
 
 
-class VADImpl
+#ifdef USE_ONNX_VAD
+// Runs the next window of many concurrent streams as one [N, window] batch, each stream keeps its own h/c state
+// and blocks in infer() until its batch is done. Windows that arrive while a batch runs form the next batch.
+class VADBatcher
+{
+    inline static logger log = new_logger("vad-batcher");
+
+public:
+    VADBatcher(std::shared_ptr<VADSessionPool> sessions, int sample_rate, int64_t window_size_samples, int max_batch)
+        : sessions(sessions), sample_rate(sample_rate), window_size_samples(window_size_samples), max_batch(std::max(1, max_batch))
+    {
+        input.resize(this->max_batch * window_size_samples);
+        for (auto buffer : { &h_in, &c_in, &h_out, &c_out })
+            buffer->resize(2 * this->max_batch * hc_size);
+        probs.resize(this->max_batch);
+        sr[0] = sample_rate;
+        bindings.resize(this->max_batch + 1);
+        thread = std::thread([this] { run(); });
+    }
+
+    ~VADBatcher()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        work_cv.notify_all();
+        thread.join();
+    }
+
+    bool matches(int sample_rate, int64_t window_size_samples) const
+    {
+        return this->sample_rate == sample_rate && this->window_size_samples == window_size_samples;
+    }
+
+    // speech probability of the window, h and c ([2, 1, 64] each) are read and updated in place
+    float infer(const float* data, float* h, float* c)
+    {
+        Request request{ data, h, c };
+        std::unique_lock<std::mutex> lock(mutex);
+        pending.push_back(&request);
+        work_cv.notify_one();
+        done_cv.wait(lock, [&] { return request.done; });
+        // a failed batch fails every stream in it
+        if (request.error)
+            std::rethrow_exception(request.error);
+        return request.prob;
+    }
+
+    VADBatchStats stats() const { return { batches.load(), windows.load() }; }
+
+private:
+    struct Request {
+        const float* data;
+        float* h;
+        float* c;
+        float prob = 0;
+        bool done = false;
+        std::exception_ptr error;
+    };
+
+    struct Binding {
+        std::vector<Ort::Value> inputs;
+        std::vector<Ort::Value> outputs;
+        int64_t input_dims[2];
+        int64_t hc_dims[3];
+        int64_t output_dims[2];
+    };
+
+    void run()
+    {
+        std::vector<Request*> batch;
+        batch.reserve(max_batch);
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                work_cv.wait(lock, [&] { return stopping || !pending.empty(); });
+                if (pending.empty())
+                    return;
+                size_t n = std::min(pending.size(), (size_t)max_batch);
+                batch.assign(pending.begin(), pending.begin() + n);
+                pending.erase(pending.begin(), pending.begin() + n);
+            }
+
+            try {
+                process(batch);
+            } catch (const std::exception& e) {
+                log.error("VAD batch of {} windows failed: {}", batch.size(), e.what());
+                for (auto request : batch)
+                    request->error = std::current_exception();
+            } catch (...) {
+                for (auto request : batch)
+                    request->error = std::current_exception();
+            }
+
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                for (auto request : batch)
+                    request->done = true;
+            }
+            done_cv.notify_all();
+        }
+    }
+
+    // tensors over the first n entries of the fixed buffers, created once per batch size
+    Binding& binding(size_t n)
+    {
+        auto& binding = bindings[n];
+        if (binding)
+            return *binding;
+        binding = std::make_unique<Binding>();
+        auto& b = *binding;
+        int64_t batch = n;
+        b.input_dims[0] = batch;
+        b.input_dims[1] = window_size_samples;
+        b.hc_dims[0] = 2;
+        b.hc_dims[1] = batch;
+        b.hc_dims[2] = hc_size;
+        b.output_dims[0] = batch;
+        b.output_dims[1] = 1;
+        b.inputs.emplace_back(Ort::Value::CreateTensor<float>(memory_info, input.data(), n * window_size_samples, b.input_dims, 2));
+        b.inputs.emplace_back(Ort::Value::CreateTensor<int64_t>(memory_info, sr, 1, sr_dims, 1));
+        b.inputs.emplace_back(Ort::Value::CreateTensor<float>(memory_info, h_in.data(), 2 * n * hc_size, b.hc_dims, 3));
+        b.inputs.emplace_back(Ort::Value::CreateTensor<float>(memory_info, c_in.data(), 2 * n * hc_size, b.hc_dims, 3));
+        b.outputs.emplace_back(Ort::Value::CreateTensor<float>(memory_info, probs.data(), n, b.output_dims, 2));
+        b.outputs.emplace_back(Ort::Value::CreateTensor<float>(memory_info, h_out.data(), 2 * n * hc_size, b.hc_dims, 3));
+        b.outputs.emplace_back(Ort::Value::CreateTensor<float>(memory_info, c_out.data(), 2 * n * hc_size, b.hc_dims, 3));
+        return b;
+    }
+
+    void process(const std::vector<Request*>& batch)
+    {
+        size_t n = batch.size();
+        const size_t row = hc_size * sizeof(float);
+
+        // gather windows and states, h/c are [layer, batch, 64]
+        for (size_t i = 0; i < n; i++) {
+            auto request = batch[i];
+            std::memcpy(input.data() + i * window_size_samples, request->data, window_size_samples * sizeof(float));
+            for (size_t layer = 0; layer < 2; layer++) {
+                std::memcpy(h_in.data() + (layer * n + i) * hc_size, request->h + layer * hc_size, row);
+                std::memcpy(c_in.data() + (layer * n + i) * hc_size, request->c + layer * hc_size, row);
+            }
+        }
+
+        auto& b = binding(n);
+        sessions->run([&](Ort::Session& session) {
+            session.Run(run_options,
+                input_node_names, b.inputs.data(), b.inputs.size(),
+                output_node_names, b.outputs.data(), b.outputs.size());
+        });
+
+        // scatter probabilities and the updated states back
+        for (size_t i = 0; i < n; i++) {
+            auto request = batch[i];
+            request->prob = probs[i];
+            for (size_t layer = 0; layer < 2; layer++) {
+                std::memcpy(request->h + layer * hc_size, h_out.data() + (layer * n + i) * hc_size, row);
+                std::memcpy(request->c + layer * hc_size, c_out.data() + (layer * n + i) * hc_size, row);
+            }
+        }
+
+        batches++;
+        windows += n;
+    }
+
+    std::shared_ptr<VADSessionPool> sessions;
+    int sample_rate;
+    int64_t window_size_samples;
+    int max_batch;
+    static constexpr size_t hc_size = 64;
+
+    Ort::MemoryInfo memory_info = Ort::MemoryInfo::CreateCpu(OrtArenaAllocator, OrtMemTypeCPU);
+    Ort::RunOptions run_options{nullptr};
+    const char* input_node_names[4] = {"input", "sr", "h", "c"};
+    const char* output_node_names[3] = {"output", "hn", "cn"};
+    std::vector<float> input;
+    int64_t sr[1] = {};
+    const int64_t sr_dims[1] = {1};
+    std::vector<float> h_in, c_in, h_out, c_out;
+    std::vector<float> probs;
+    std::vector<std::unique_ptr<Binding>> bindings;    // by batch size
+
+    std::mutex mutex;
+    std::condition_variable work_cv;
+    std::condition_variable done_cv;
+    std::vector<Request*> pending;
+    bool stopping = false;
+    std::thread thread;
+
+    std::atomic<size_t> batches = 0;
+    std::atomic<size_t> windows = 0;
+};
+#endif
+
+
+// Silero model inference for a single stream: the window and the h/c state live in fixed buffers, the stream
+// leases a session of the model's pool at its first window until release_session() (the native model runs
+// concurrently on the callers' threads)
+class VADInference
 {
+public:
+    VADInference(VADModelImpl& model, int sample_rate, int64_t window_size_samples, bool batched = false)
+        : native(model.native.get()), sample_rate(sample_rate), window_size_samples(window_size_samples)
+    {
+        if (native)
+            return;
+#ifdef USE_ONNX_VAD
+        sessions = model.sessions;
+        v5 = model.version >= 5;
+        context_size = model.context_size(sample_rate);
+        if (batched && !v5 && model.batcher && model.batcher->matches(sample_rate, window_size_samples))
+            batcher = model.batcher.get();
+
+        input.resize(context_size + window_size_samples);
+        input_node_dims[0] = 1;
+        input_node_dims[1] = input.size();
+
+        sr.resize(1);
+        sr[0] = sample_rate;
+
+        init_bindings();
+#endif
+    }
+
+    ~VADInference() { flush_gate_stats(); }
+
+    VADInference(const VADInference&) = delete;
+    VADInference& operator=(const VADInference&) = delete;
+
+    void set_gate(const VADGate& gate)
+    {
+        flush_gate_stats();
+        this->gate = gate;
+    }
+
+    // gives the session back to the pool, e.g. at the end of the stream or while it waits for input
+    void release_session()
+    {
+        flush_gate_stats();
+#ifdef USE_ONNX_VAD
+        lease.reset();
+#endif
+    }
+
+    void reset()
+    {
+        native_state.reset();
+#ifdef USE_ONNX_VAD
+        for (int i = 0; i < 2; i++) {
+            std::memset(_h[i].data(), 0, _h[i].size() * sizeof(float));
+            std::memset(_c[i].data(), 0, _c[i].size() * sizeof(float));
+        }
+        std::memset(input.data(), 0, input.size() * sizeof(float));
+        current_binding = 0;
+#endif
+    }
+
+    // speech probability of one window, the window is copied into the bound input buffer (2 KB at 16 kHz)
+    float infer(const float* data)
+    {
+        if (gate.rms_floor > 0) {
+            float rms, peak;
+            energy(data, window_size_samples, rms, peak);
+            gate_windows++;
+            if (rms < gate.rms_floor && peak < gate.peak_floor) {
+                // digital silence, the recurrent state restarts as at the beginning of a stream
+                gate_skipped++;
+                reset();
+                return 0;
+            }
+        }
+        if (native)
+            return native->infer(data, native_state, sample_rate);
+#ifdef USE_ONNX_VAD
+        if (batcher)
+            return batcher->infer(data, _h[current_binding].data(), _c[current_binding].data());
+        // v5: the tail of the previous input becomes the context of this one
+        if (context_size > 0)
+            std::memmove(input.data(), input.data() + window_size_samples, context_size * sizeof(float));
+        std::memcpy(input.data() + context_size, data, window_size_samples * sizeof(float));
+        auto& binding = bindings[current_binding];
+        if (!lease)
+            lease = sessions->lease();
+        lease->session().Run(run_options,
+            input_node_names.data(), binding.inputs.data(), binding.inputs.size(),
+            output_node_names.data(), binding.outputs.data(), binding.outputs.size());
+        current_binding ^= 1;
+        return output_prob;
+#else
+        return 0;
+#endif
+    }
+
+    // previous inference path with fresh tensors and outputs for every window, kept as a reference for bench_vad()
+    float infer_allocating(const float* data)
+    {
+        if (native || v5)
+            return infer(data);
+#ifdef USE_ONNX_VAD
+        std::vector<float> r{ data, data + window_size_samples };
+        auto& h = _h[current_binding];
+        auto& c = _c[current_binding];
+
+        std::vector<Ort::Value> ort_inputs;
+        ort_inputs.emplace_back(Ort::Value::CreateTensor<float>(memory_info, r.data(), r.size(), input_node_dims, 2));
+        ort_inputs.emplace_back(Ort::Value::CreateTensor<int64_t>(memory_info, sr.data(), sr.size(), sr_node_dims, 1));
+        ort_inputs.emplace_back(Ort::Value::CreateTensor<float>(memory_info, h.data(), h.size(), hc_node_dims, 3));
+        ort_inputs.emplace_back(Ort::Value::CreateTensor<float>(memory_info, c.data(), c.size(), hc_node_dims, 3));
+
+        if (!lease)
+            lease = sessions->lease();
+        std::vector<Ort::Value> ort_outputs = lease->session().Run(
+                Ort::RunOptions{nullptr},
+                input_node_names.data(), ort_inputs.data(), ort_inputs.size(),
+                output_node_names.data(), output_node_names.size());
+
+        std::memcpy(h.data(), ort_outputs[1].GetTensorMutableData<float>(), size_hc * sizeof(float));
+        std::memcpy(c.data(), ort_outputs[2].GetTensorMutableData<float>(), size_hc * sizeof(float));
+        return ort_outputs[0].GetTensorMutableData<float>()[0];
+#else
+        return 0;
+#endif
+    }
+
 private:
-    // Ort::AllocatorWithDefaultOptions allocator;
+    // the model wide counters are shared by all streams, so they are updated once per stream instead of per window
+    void flush_gate_stats()
+    {
+        if (gate_windows > 0 && gate.windows)
+            *gate.windows += gate_windows;
+        if (gate_skipped > 0 && gate.skipped)
+            *gate.skipped += gate_skipped;
+        gate_windows = gate_skipped = 0;
+    }
+
+    const SileroNativeModel* native = nullptr;
+    SileroNativeModel::State native_state;
+    int sample_rate;
+    int64_t window_size_samples;
+    VADGate gate;
+    size_t gate_windows = 0;
+    size_t gate_skipped = 0;
+    bool v5 = false;
+
+#ifdef USE_ONNX_VAD
+    // pre-created tensors over fixed buffers: the two bindings ping-pong h/c between inputs and outputs,
+    // so the hot loop neither allocates nor copies the state
+    void init_bindings()
+    {
+        for (int i = 0; i < 2; i++) {
+            _h[i].resize(v5 ? size_state : size_hc);
+            _c[i].resize(size_hc);
+        }
+        if (v5) {
+            // v5: one [2, 1, 128] state ping-pongs in _h, _c is unused
+            input_node_names = {"input", "state", "sr"};
+            output_node_names = {"output", "stateN"};
+        }
+        for (int i = 0; i < 2; i++) {
+            auto& binding = bindings[i];
+            int o = i ^ 1;
+            binding.inputs.clear();
+            binding.outputs.clear();
+            if (v5) {
+                binding.inputs.emplace_back(Ort::Value::CreateTensor<float>(memory_info, input.data(), input.size(), input_node_dims, 2));
+                binding.inputs.emplace_back(Ort::Value::CreateTensor<float>(memory_info, _h[i].data(), _h[i].size(), state_node_dims, 3));
+                binding.inputs.emplace_back(Ort::Value::CreateTensor<int64_t>(memory_info, sr.data(), sr.size(), sr_node_dims, 1));
+                binding.outputs.emplace_back(Ort::Value::CreateTensor<float>(memory_info, &output_prob, 1, output_node_dims, 2));
+                binding.outputs.emplace_back(Ort::Value::CreateTensor<float>(memory_info, _h[o].data(), _h[o].size(), state_node_dims, 3));
+                continue;
+            }
+            binding.inputs.emplace_back(Ort::Value::CreateTensor<float>(memory_info, input.data(), input.size(), input_node_dims, 2));
+            binding.inputs.emplace_back(Ort::Value::CreateTensor<int64_t>(memory_info, sr.data(), sr.size(), sr_node_dims, 1));
+            binding.inputs.emplace_back(Ort::Value::CreateTensor<float>(memory_info, _h[i].data(), _h[i].size(), hc_node_dims, 3));
+            binding.inputs.emplace_back(Ort::Value::CreateTensor<float>(memory_info, _c[i].data(), _c[i].size(), hc_node_dims, 3));
+            binding.outputs.emplace_back(Ort::Value::CreateTensor<float>(memory_info, &output_prob, 1, output_node_dims, 2));
+            binding.outputs.emplace_back(Ort::Value::CreateTensor<float>(memory_info, _h[o].data(), _h[o].size(), hc_node_dims, 3));
+            binding.outputs.emplace_back(Ort::Value::CreateTensor<float>(memory_info, _c[o].data(), _c[o].size(), hc_node_dims, 3));
+        }
+    }
+
     Ort::MemoryInfo memory_info = Ort::MemoryInfo::CreateCpu(OrtArenaAllocator, OrtMemTypeCPU);
-    // VADModelImpl& model;
-    std::shared_ptr<Ort::Session> session = nullptr;
+    std::shared_ptr<VADSessionPool> sessions;
+    std::unique_ptr<VADSessionPool::Lease> lease;
+    VADBatcher* batcher = nullptr;  // shared service running this stream's windows in batches
+
+    // Inputs
+    std::vector<const char *> input_node_names = {"input", "sr", "h", "c"};
+    std::vector<float> input;           // [context | window], context only for v5
+    int64_t context_size = 0;
+    std::vector<int64_t> sr;
+    unsigned int size_hc = 2 * 1 * 64; // It's FIXED.
+    unsigned int size_state = 2 * 1 * 128;
+    std::vector<float> _h[2];
+    std::vector<float> _c[2];
+
+    int64_t input_node_dims[2] = {}; 
+    const int64_t sr_node_dims[1] = {1};
+    const int64_t hc_node_dims[3] = {2, 1, 64};
+    const int64_t state_node_dims[3] = {2, 1, 128};
+
+    // Outputs
+    std::vector<const char *> output_node_names = {"output", "hn", "cn"};
+    float output_prob = 0;
+    const int64_t output_node_dims[2] = {1, 1};
+
+    // inputs and outputs of the two h/c ping-pong bindings
+    struct {
+        std::vector<Ort::Value> inputs;
+        std::vector<Ort::Value> outputs;
+    } bindings[2];
+    int current_binding = 0;
+    Ort::RunOptions run_options{nullptr};
+#endif
+};
+
+
+// samples of a detection, 16-bit input is converted window by window; with step > 1 the input is at step times
+// the model rate (e.g. 8 kHz telephony audio converted to 16 kHz for whisper) and every step samples are averaged
+struct VADInput {
+    const float* f32 = nullptr;
+    const int16_t* s16 = nullptr;
+    int step = 1;
+
+    // offset and size at the model rate
+    const float* window(size_t offset, size_t size, std::vector<float>& buffer) const {
+        if (step > 1) {
+            buffer.resize(size);
+            const float gain = 1.0f / step;
+            for (size_t i = 0, j = offset * step; i < size; i++) {
+                float sum = 0;
+                for (int k = 0; k < step; k++, j++)
+                    sum += f32 ? f32[j] : s16[j] * (1.0f / 32768);
+                buffer[i] = sum * gain;
+            }
+            return buffer.data();
+        }
+        if (f32)
+            return f32 + offset;
+        buffer.resize(size);
+        s16_to_f32(s16 + offset, buffer.data(), size);
+        return buffer.data();
+    }
+};
+
+class VADImpl
+{
+private:
+    VADModelImpl& model;
+    VADInference inference;
+    VADGate gate;
 
 private:
     void reset_states()
     {
         // Call reset before each audio start
-        std::memset(_h.data(), 0.0f, _h.size() * sizeof(float));
-        std::memset(_c.data(), 0.0f, _c.size() * sizeof(float));
+        stop_parallel();
+        inference.reset();
         triggered = false;
         temp_end = 0;
         current_sample = 0;
@@ -148,40 +793,15 @@ private:
         current_speech = timestamp_t();
     };
 
-    void predict(const std::vector<float> &data)
-    {
-        // Infer
-        // Create ort tensors
-        input.assign(data.begin(), data.end());
-        Ort::Value input_ort = Ort::Value::CreateTensor<float>(
-            memory_info, input.data(), input.size(), input_node_dims, 2);
-        Ort::Value sr_ort = Ort::Value::CreateTensor<int64_t>(
-            memory_info, sr.data(), sr.size(), sr_node_dims, 1);
-        Ort::Value h_ort = Ort::Value::CreateTensor<float>(
-            memory_info, _h.data(), _h.size(), hc_node_dims, 3);
-        Ort::Value c_ort = Ort::Value::CreateTensor<float>(
-            memory_info, _c.data(), _c.size(), hc_node_dims, 3);
-
-        // Clear and add inputs
-        ort_inputs.clear();
-        ort_inputs.emplace_back(std::move(input_ort));
-        ort_inputs.emplace_back(std::move(sr_ort));
-        ort_inputs.emplace_back(std::move(h_ort));
-        ort_inputs.emplace_back(std::move(c_ort));
-
-        // Infer
-        ort_outputs = session->Run(
-            Ort::RunOptions{nullptr},
-            input_node_names.data(), ort_inputs.data(), ort_inputs.size(),
-            output_node_names.data(), output_node_names.size());
-
-        // Output probability & update h,c recursively
-        float speech_prob = ort_outputs[0].GetTensorMutableData<float>()[0];
-        float *hn = ort_outputs[1].GetTensorMutableData<float>();
-        std::memcpy(_h.data(), hn, size_hc * sizeof(float));
-        float *cn = ort_outputs[2].GetTensorMutableData<float>();
-        std::memcpy(_c.data(), cn, size_hc * sizeof(float));
+    void predict(const float* data)
+    {
+        update(probability(current_sample / window_size_samples, data));
+    }
+
 
+    // speech range state machine, advanced by one window
+    void update(float speech_prob)
+    {
         // Push forward sample index
         current_sample += window_size_samples;
 
@@ -214,7 +834,7 @@ private:
             if (prev_end > 0) {
                 current_speech.end = prev_end;
                 speeches.push_back(current_speech);
-                speeches2.emplace_back(current_speech.start, current_speech.end);
+                speeches2.emplace_back(current_speech.start * decimation, current_speech.end * decimation);
                 current_speech = timestamp_t();
                 
                 // previously reached silence(< neg_thres) and is still not speech(< thres)
@@ -231,7 +851,7 @@ private:
             else{ 
                 current_speech.end = current_sample;
                 speeches.push_back(current_speech);
-                speeches2.emplace_back(current_speech.start, current_speech.end);
+                speeches2.emplace_back(current_speech.start * decimation, current_speech.end * decimation);
                 current_speech = timestamp_t();
                 prev_end = 0;
                 next_start = 0;
@@ -286,7 +906,7 @@ private:
                     if (current_speech.end - current_speech.start > min_speech_samples)
                     {
                         speeches.push_back(current_speech);
-                        speeches2.emplace_back(current_speech.start, current_speech.end);
+                        speeches2.emplace_back(current_speech.start * decimation, current_speech.end * decimation);
                         current_speech = timestamp_t();
                         prev_end = 0;
                         next_start = 0;
@@ -314,8 +934,7 @@ public:
         {
             if (j + window_size_samples > audio_length_samples)
                 break;
-            std::vector<float> r{ &input_wav[0] + j, &input_wav[0] + j + window_size_samples };
-            predict(r);
+            predict(&input_wav[0] + j);
 
             for (int i = output_speeches; i < speeches.size(); i++) {
                 auto& s = speeches[i];
@@ -327,7 +946,7 @@ public:
         if (current_speech.start >= 0) {
             current_speech.end = audio_length_samples;
             speeches.push_back(current_speech);
-            speeches2.emplace_back(current_speech.start, current_speech.end);
+            speeches2.emplace_back(current_speech.start * decimation, current_speech.end * decimation);
             current_speech = timestamp_t();
             prev_end = 0;
             next_start = 0;
@@ -351,8 +970,7 @@ public:
         {
             if (j + window_size_samples > audio_length_samples)
                 break;
-            std::vector<float> r{ &input_wav[0] + j, &input_wav[0] + j + window_size_samples };
-            predict(r);
+            predict(&input_wav[0] + j);
 
             if (output_speeches < speeches.size()) {
                 // for (int i = output_speeches; i < speeches.size(); i++) {
@@ -368,7 +986,7 @@ public:
         if (current_speech.start >= 0) {
             current_speech.end = audio_length_samples;
             speeches.push_back(current_speech);
-            speeches2.emplace_back(current_speech.start, current_speech.end);
+            speeches2.emplace_back(current_speech.start * decimation, current_speech.end * decimation);
             current_speech = timestamp_t();
             prev_end = 0;
             next_start = 0;
@@ -449,25 +1067,108 @@ private:
     std::vector<speech_range> speeches2;
     timestamp_t current_speech;
 
+    // speech probabilities of long inputs computed ahead in parallel chunks, each chunk starts from a reset state
+    // and first runs the warm-up audio before it to converge the LSTM state, the state machine still consumes
+    // the probabilities sequentially, so ranges across chunk borders come out the same way as without chunks
+    struct Parallel {
+        std::vector<float> probs;
+        std::vector<char> ready;    // per chunk
+        std::mutex mutex;
+        std::condition_variable cv;
+        std::atomic<size_t> next_chunk = 0;
+        std::atomic_bool cancel = false;
+        std::exception_ptr error;   // of the first failed worker (guarded by mutex)
+        std::vector<std::thread> threads;
+    };
+    int decimation = 1;     // input samples per model sample, ranges are reported in input samples
+    int parallel_threads = 1;
+    size_t parallel_chunk_windows = 0;
+    size_t parallel_warmup_windows = 0;
+    std::unique_ptr<Parallel> parallel;
+    size_t parallel_available = 0;  // windows of the ready chunks in order
+    std::atomic_bool stopped = false;
+
+    void start_parallel(VADInput samples, size_t count)
+    {
+        size_t n = count / window_size_samples;
+        size_t chunk = parallel_chunk_windows;
+        size_t warmup = parallel_warmup_windows;
+        size_t chunks = (n + chunk - 1) / chunk;
+
+        parallel = std::make_unique<Parallel>();
+        parallel->probs.assign(n, 0);
+        parallel->ready.assign(chunks, 0);
+        parallel_available = 0;
+
+        auto p = parallel.get();
+        int64_t ws = window_size_samples;
+        size_t threads = std::min((size_t)parallel_threads, chunks);
+        for (size_t t = 0; t < threads; t++) {
+            p->threads.emplace_back([this, p, samples, n, chunk, warmup, chunks, ws] {
+                try {
+                    VADInference worker(model, sample_rate, ws);
+                    worker.set_gate(gate);
+                    std::vector<float> buffer;
+                    // chunks are taken in order, so the consumer is served from the start of the input
+                    for (size_t k; !p->cancel && (k = p->next_chunk++) < chunks;) {
+                        size_t begin = k * chunk;
+                        size_t end = std::min(n, begin + chunk);
+                        worker.reset();
+                        for (size_t w = begin > warmup ? begin - warmup : 0; w < begin && !p->cancel; w++)
+                            worker.infer(samples.window(w * ws, ws, buffer));
+                        for (size_t w = begin; w < end && !p->cancel; w++)
+                            p->probs[w] = worker.infer(samples.window(w * ws, ws, buffer));
+                        {
+                            std::lock_guard<std::mutex> lock(p->mutex);
+                            p->ready[k] = 1;
+                        }
+                        p->cv.notify_all();
+                    }
+                } catch (...) {
+                    // the consumer rethrows the first error instead of waiting for chunks that never come;
+                    // the error is set before cancel, so chunks cut short by the cancel are never taken as complete
+                    {
+                        std::lock_guard<std::mutex> lock(p->mutex);
+                        if (!p->error)
+                            p->error = std::current_exception();
+                        std::fill(p->ready.begin(), p->ready.end(), 1);
+                    }
+                    p->cancel = true;
+                    p->cv.notify_all();
+                }
+            });
+        }
+    }
 
-    // Onnx model
-    // Inputs
-    std::vector<Ort::Value> ort_inputs;
-    
-    std::vector<const char *> input_node_names = {"input", "sr", "h", "c"};
-    std::vector<float> input;
-    std::vector<int64_t> sr;
-    unsigned int size_hc = 2 * 1 * 64; // It's FIXED.
-    std::vector<float> _h;
-    std::vector<float> _c;
-
-    int64_t input_node_dims[2] = {}; 
-    const int64_t sr_node_dims[1] = {1};
-    const int64_t hc_node_dims[3] = {2, 1, 64};
+    void stop_parallel()
+    {
+        if (!parallel)
+            return;
+        parallel->cancel = true;
+        for (auto& thread : parallel->threads)
+            thread.join();
+        parallel.reset();
+    }
 
-    // Outputs
-    std::vector<Ort::Value> ort_outputs;
-    std::vector<const char *> output_node_names = {"output", "hn", "cn"};
+    // probability of window w at data, waits for its chunk in the parallel mode
+    float probability(size_t w, const float* data)
+    {
+        if (!parallel || w >= parallel->probs.size())
+            return inference.infer(data);
+        if (w >= parallel_available) {
+            auto& p = *parallel;
+            size_t k = w / parallel_chunk_windows;
+            std::unique_lock<std::mutex> lock(p.mutex);
+            p.cv.wait(lock, [&] { return p.ready[k] != 0; });
+            if (p.error)
+                std::rethrow_exception(p.error);
+            // extend over the following chunks that are ready too
+            while (k < p.ready.size() && p.ready[k])
+                k++;
+            parallel_available = std::min(p.probs.size(), k * parallel_chunk_windows);
+        }
+        return parallel->probs[w];
+    }
 
 public:
     // Construction
@@ -475,14 +1176,15 @@ public:
         int Sample_rate = 16000, int windows_frame_size = 64,
         float Threshold = 0.5, int min_silence_duration_ms = 0,
         int speech_pad_ms = 64, int min_speech_duration_ms = 64,
-        float max_speech_duration_s = std::numeric_limits<float>::infinity()) : session(model.session) // model(model)
+        float max_speech_duration_s = std::numeric_limits<float>::infinity(), bool batched = false) : model(model),
+          inference(model, Sample_rate, model.window_size(Sample_rate) > 0 ? model.window_size(Sample_rate) : windows_frame_size * (Sample_rate / 1000), batched)
     {
         // init_onnx_model(ModelPath);
         threshold = Threshold;
         sample_rate = Sample_rate;
         sr_per_ms = sample_rate / 1000;
 
-        window_size_samples = windows_frame_size * sr_per_ms;
+        window_size_samples = model.window_size(sample_rate) > 0 ? model.window_size(sample_rate) : windows_frame_size * sr_per_ms;
 
         min_speech_samples = sr_per_ms * min_speech_duration_ms;
         speech_pad_samples = sr_per_ms * speech_pad_ms;
@@ -496,22 +1198,57 @@ public:
         min_silence_samples = sr_per_ms * min_silence_duration_ms;
         min_silence_samples_at_max_speech = sr_per_ms * 98;
 
-        input.resize(window_size_samples);
-        input_node_dims[0] = 1;
-        input_node_dims[1] = window_size_samples;
+    }
 
-        _h.resize(size_hc);
-        _c.resize(size_hc);
-        sr.resize(1);
-        sr[0] = sample_rate;
+    ~VADImpl() { stop_parallel(); }
+
+    // makes next() return false before the following window, may be called from another thread
+    void stop() { stopped = true; }
+    bool is_stopped() const { return stopped; }
+
+    // windows with RMS below floor_db (dBFS) and peak 20 dB above it are silence without running the model
+    void set_gate(bool enable, float floor_db)
+    {
+        gate = VADGate();
+        if (enable) {
+            gate.rms_floor = db_to_amplitude(floor_db);
+            gate.peak_floor = db_to_amplitude(floor_db + 20);
+            gate.windows = &model.gate_windows;
+            gate.skipped = &model.gate_skipped;
+        }
+        inference.set_gate(gate);
+    }
+
+    void set_decimation(int factor) { decimation = std::max(1, factor); }
+
+    void set_parallel(int threads, float chunk_s, float warmup_s)
+    {
+        parallel_threads = threads;
+        parallel_chunk_windows = std::max<size_t>(1, chunk_s * sample_rate / window_size_samples);
+        parallel_warmup_windows = std::max<float>(0, warmup_s * sample_rate / window_size_samples);
+    }
+
+    // speech probabilities of all full windows without the speech range state machine
+    void probabilities(const float* samples, size_t count, std::vector<float>& probs, bool allocating = false)
+    {
+        reset_states();
+        probs.clear();
+        probs.reserve(count / window_size_samples);
+        for (size_t j = 0; j + window_size_samples <= count; j += window_size_samples)
+            probs.push_back(allocating ? inference.infer_allocating(samples + j) : inference.infer(samples + j));
     }
 
+    int64_t window_size() const { return window_size_samples; }
+
 private:
     struct {
         // const std::vector<float>* input_wav;
-        const float* samples;
+        VADInput samples;
         int j;
         size_t output_speeches;
+        SampleWait wait;    // input still growing
+        size_t available;
+        std::vector<float> buffer;  // converted window of 16-bit input
     } state;
 
 public:
@@ -519,15 +1256,44 @@ public:
         start(samples.data(), samples.size());
     }
 
-    void start(const float *samples, size_t count) {
+    void start(const float *samples, size_t count, SampleWait wait = nullptr) {
+        start(VADInput{ samples, nullptr }, count, wait);
+    }
+
+    void start(const int16_t *samples, size_t count, SampleWait wait = nullptr) {
+        start(VADInput{ nullptr, samples }, count, wait);
+    }
+
+    // count in input samples
+    void start(VADInput samples, size_t count, SampleWait wait) {
         reset_states();
+        stopped = false;
+        if (decimation > 1) {
+            samples.step = decimation;
+            count /= decimation;
+            if (wait)
+                wait = [wait, d = (size_t)decimation](size_t n) { return wait(n * d) / d; };
+        }
+        // the parallel chunks would read ahead of a growing input
+        if (!wait && parallel_threads > 1 && parallel_chunk_windows > 0 && count / window_size_samples > 2 * parallel_chunk_windows)
+            start_parallel(samples, count);
         state.samples = samples;
         audio_length_samples = count;
         state.j = 0;
         state.output_speeches = 0;
+        state.wait = wait;
+        state.available = wait ? 0 : count;
     }
 
+    // the next speech range, the model session is given back once there are no more
     bool next() {
+        if (advance())
+            return true;
+        inference.release_session();
+        return false;
+    }
+
+    bool advance() {
 
         if (state.j >= audio_length_samples)
             return false;
@@ -539,13 +1305,26 @@ public:
 
         while (speeches2.size() == prev_size) {
 
+            if (stopped)
+                return false;
+
             auto j = state.j;
 
             if (j + window_size_samples > audio_length_samples)
                 break;
 
-            std::vector<float> r{ &samples[0] + j, &samples[0] + j + window_size_samples };
-            predict(r);
+            // a growing input may end before its expected length
+            if (j + window_size_samples > state.available) {
+                // the session serves other streams while this one waits for the upload
+                inference.release_session();
+                state.available = state.wait(j + window_size_samples);
+                if (j + window_size_samples > state.available) {
+                    audio_length_samples = state.available;
+                    break;
+                }
+            }
+
+            predict(samples.window(j, window_size_samples, state.buffer));
 
             state.j += window_size_samples;
         }
@@ -554,7 +1333,7 @@ public:
             if (current_speech.start >= 0) {
                 current_speech.end = audio_length_samples;
                 speeches.push_back(current_speech);
-                speeches2.emplace_back(current_speech.start, current_speech.end);
+                speeches2.emplace_back(current_speech.start * decimation, current_speech.end * decimation);
                 current_speech = timestamp_t();
                 prev_end = 0;
                 next_start = 0;
@@ -617,12 +1396,12 @@ public:
 VADModel::VADModel() {}
 
 // VADModel::VADModel(const std::string& model_path) : impl(std::make_unique<VADModelImpl>(model_path)) {}
-VADModel::VADModel(const std::string& model_path) : impl(nullptr)
+VADModel::VADModel(const std::string& model_path, VADEngineConfig engine) : impl(nullptr)
 {
     if (model_path.empty())
         return;
     try {
-        impl = std::make_unique<VADModelImpl>(model_path);
+        impl = std::make_unique<VADModelImpl>(model_path, engine);
     } catch (const std::exception& e) {
         what = e.what();
     }
@@ -632,6 +1411,38 @@ VADModel::~VADModel() {}
 
 VADModel::operator bool() const { return (bool)impl; }
 
+bool VADModel::supports(int sample_rate) const { return impl && impl->supports(sample_rate); }
+
+void VADModel::setBatching(int max_batch, int sample_rate, int windows_frame_size_ms) {
+#ifdef USE_ONNX_VAD
+    // the native engine has no per call overhead worth batching, the batcher runs the v4 h/c layout only
+    if (!impl || !impl->sessions || impl->version >= 5)
+        return;
+    impl->batcher = max_batch > 1 ?
+        std::make_shared<VADBatcher>(impl->sessions, sample_rate, windows_frame_size_ms * (sample_rate / 1000), max_batch) : nullptr;
+#endif
+}
+
+VADGateStats VADModel::gateStats() const {
+    return impl ? VADGateStats{ impl->gate_windows.load(), impl->gate_skipped.load() } : VADGateStats();
+}
+
+std::vector<VADSessionStats> VADModel::sessionStats() const {
+#ifdef USE_ONNX_VAD
+    return impl && impl->sessions ? impl->sessions->stats() : std::vector<VADSessionStats>();
+#else
+    return {};
+#endif
+}
+
+VADBatchStats VADModel::batchStats() const {
+#ifdef USE_ONNX_VAD
+    return impl && impl->batcher ? impl->batcher->stats() : VADBatchStats();
+#else
+    return VADBatchStats();
+#endif
+}
+
 
 class VAD::IteratorImpl : public VADImpl::Iterator {
 public:
@@ -647,7 +1458,15 @@ VAD::VAD(VADModel& model, VADConfig config)
                 config.min_silence_duration_ms,
                 config.speech_pad_ms,
                 config.min_speech_duration_ms,
-                config.max_speech_duration_s)), _sample_rate(config.sample_rate) {
+                config.max_speech_duration_s,
+                config.batched)), _sample_rate(config.sample_rate), config(config), model_name(model.impl->name) {
+    // e.g. 16 kHz whisper input of 8 kHz audio runs through the model's 8 kHz branch
+    if (config.input_sample_rate > config.sample_rate && config.input_sample_rate % config.sample_rate == 0) {
+        impl->set_decimation(config.input_sample_rate / config.sample_rate);
+        _sample_rate = config.input_sample_rate;
+    }
+    impl->set_parallel(config.parallel_threads, config.parallel_chunk_s, config.parallel_warmup_s);
+    impl->set_gate(config.energy_gate, config.energy_floor_db);
 }
 
 VAD::~VAD() {}
@@ -660,11 +1479,87 @@ size_t VAD::size() const {
     return impl->size();
 }
 
-void VAD::start(const float *samples, size_t count) {
-    impl->start(samples, count);
+void VAD::start(const float *samples, size_t count, SampleWait wait) {
+    impl->start(samples, count, wait);
+    impl->next();
+}
+
+void VAD::start(const int16_t *samples, size_t count, SampleWait wait) {
+    impl->start(samples, count, wait);
     impl->next();
 }
 
+void VAD::stop() {
+    impl->stop();
+}
+
+bool VAD::stopped() const {
+    return impl->is_stopped();
+}
+
+// 64-bit multiply-xorshift hash of 8 byte words, fast enough to key hours of samples
+static uint64_t content_hash_words(uint64_t h, const uint8_t* bytes, size_t size) {
+    for (size_t i = 0; i + 8 <= size; i += 8) {
+        uint64_t w;
+        std::memcpy(&w, bytes + i, 8);
+        h = (h ^ w) * 0xff51afd7ed558ccdull;
+        h ^= h >> 32;
+    }
+    return h;
+}
+
+static uint64_t content_hash_finish(uint64_t h, const uint8_t* tail, size_t size) {
+    for (size_t i = 0; i < size; i++)
+        h = (h ^ tail[i]) * 0x100000001b3ull;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ull;
+    return h ^ (h >> 33);
+}
+
+static uint64_t content_hash(const void* data, size_t size) {
+    const uint8_t* bytes = (const uint8_t*)data;
+    size_t words = size & ~(size_t)7;
+    return content_hash_finish(content_hash_words(0x9e3779b97f4a7c15ull ^ size, bytes, words), bytes + words, size - words);
+}
+
+// hash of the float form, so that both forms of the same audio share cache entries
+static uint64_t content_hash(const int16_t* samples, size_t count) {
+    const size_t block = 4096;
+    std::vector<float> buffer(block);
+    uint64_t h = 0x9e3779b97f4a7c15ull ^ (count * sizeof(float));
+    size_t i = 0;
+    for (; i + block <= count; i += block) {
+        s16_to_f32(samples + i, buffer.data(), block);
+        h = content_hash_words(h, (const uint8_t*)buffer.data(), block * sizeof(float));
+    }
+    size_t size = (count - i) * sizeof(float);
+    size_t words = size & ~(size_t)7;
+    s16_to_f32(samples + i, buffer.data(), count - i);
+    h = content_hash_words(h, (const uint8_t*)buffer.data(), words);
+    return content_hash_finish(h, (const uint8_t*)buffer.data() + words, size - words);
+}
+
+std::string VAD::cache_key(const float* samples, size_t count) const {
+    return cache_key(content_hash(samples, count * sizeof(float)), count);
+}
+
+std::string VAD::cache_key(const int16_t* samples, size_t count) const {
+    return cache_key(content_hash(samples, count), count);
+}
+
+std::string VAD::cache_key(uint64_t hash, size_t count) const {
+    // batching and the number of parallel threads do not change the ranges, the parallel chunking does
+    bool parallel = config.parallel_threads > 1;
+    std::ostringstream key;
+    key << std::hex << hash << std::dec << ':' << count << ':' << model_name
+        << ':' << config.sample_rate << (_sample_rate != config.sample_rate ? "/" + std::to_string(_sample_rate) : "")
+        << ':' << config.windows_frame_size_ms << ':' << config.threshold
+        << ':' << config.min_silence_duration_ms << ':' << config.speech_pad_ms << ':' << config.min_speech_duration_ms
+        << ':' << config.max_speech_duration_s << ':' << (config.energy_gate ? config.energy_floor_db : 0)
+        << ':' << (parallel ? config.parallel_chunk_s : 0) << ':' << (parallel ? config.parallel_warmup_s : 0);
+    return key.str();
+}
+
 VAD::Iterator VAD::begin() { return Iterator(new IteratorImpl(impl->begin())); }
 VAD::Iterator VAD::end() { return Iterator(new IteratorImpl(impl->end())); }
 
@@ -679,6 +1574,89 @@ bool VAD::Iterator::operator==(const VAD::Iterator& other) const {
     return *impl == *other.impl;
 }
 
+class VADRangeCacheImpl {
+public:
+    VADRangeCacheImpl(size_t max_entries) : max_entries(std::max<size_t>(1, max_entries)) {}
+
+    std::optional<std::vector<speech_range>> get(const std::string& key) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (auto it = entries.find(key); it != entries.end()) {
+                // most recently used first
+                lru.splice(lru.begin(), lru, it->second.second);
+                hits++;
+                return it->second.first;
+            }
+        }
+        if (load) {
+            if (auto ranges = load(key); ranges) {
+                std::lock_guard<std::mutex> lock(mutex);
+                hits++;
+                insert(key, ranges.value());
+                return ranges;
+            }
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        misses++;
+        return std::nullopt;
+    }
+
+    void put(const std::string& key, const std::vector<speech_range>& ranges, const std::string& owner) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            insert(key, ranges);
+        }
+        if (store)
+            store(key, owner, ranges);
+    }
+
+    VADCacheStats stats() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return { entries.size(), hits, misses };
+    }
+
+    VADRangeCache::Store store;
+    VADRangeCache::Load load;
+
+private:
+    void insert(const std::string& key, const std::vector<speech_range>& ranges) {
+        if (auto it = entries.find(key); it != entries.end()) {
+            it->second.first = ranges;
+            lru.splice(lru.begin(), lru, it->second.second);
+            return;
+        }
+        lru.push_front(key);
+        entries.emplace(key, std::make_pair(ranges, lru.begin()));
+        while (entries.size() > max_entries) {
+            entries.erase(lru.back());
+            lru.pop_back();
+        }
+    }
+
+    std::mutex mutex;
+    size_t max_entries;
+    std::list<std::string> lru;
+    std::unordered_map<std::string, std::pair<std::vector<speech_range>, std::list<std::string>::iterator>> entries;
+    size_t hits = 0;
+    size_t misses = 0;
+};
+
+VADRangeCache::VADRangeCache(size_t max_entries) : impl(std::make_unique<VADRangeCacheImpl>(max_entries)) {}
+
+VADRangeCache::~VADRangeCache() {}
+
+void VADRangeCache::setStore(Store store, Load load) {
+    impl->store = store;
+    impl->load = load;
+}
+
+std::optional<std::vector<speech_range>> VADRangeCache::get(const std::string& key) { return impl->get(key); }
+
+void VADRangeCache::put(const std::string& key, const std::vector<speech_range>& ranges, const std::string& owner) { impl->put(key, ranges, owner); }
+
+VADCacheStats VADRangeCache::stats() const { return impl->stats(); }
+
+
 speech_range& VAD::Iterator::operator*() const {
     return *(*impl);
 }
@@ -729,3 +1707,214 @@ void test_vad_range(const std::string& path, const std::vector<float>& data, VAD
     }
     std::cout << "number of speeches detected: "  << vad.size() << std::endl;
 }
+
+void bench_vad(const std::string& path, const float* samples, size_t count, VADConfig config) {
+    VADModelImpl model(path);
+    if (!model.supports(config.sample_rate)) {
+        std::cout << "the model does not support " << config.sample_rate << " Hz" << std::endl;
+        return;
+    }
+    VADImpl vad(model,
+                config.sample_rate,
+                config.windows_frame_size_ms,
+                config.threshold,
+                config.min_silence_duration_ms,
+                config.speech_pad_ms,
+                config.min_speech_duration_ms,
+                config.max_speech_duration_s);
+
+    std::vector<float> probs[2];
+
+    // warm up, the first runs include session initialization
+    vad.probabilities(samples, std::min(count, (size_t)config.sample_rate), probs[0]);
+
+    const char* names[2] = { "allocating", "bound" };
+    double windows_per_s[2] = {};
+    for (int i = 0; i < 2; i++) {
+        auto t0 = std::chrono::steady_clock::now();
+        vad.probabilities(samples, count, probs[i], i == 0);
+        double s = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+        windows_per_s[i] = s > 0 ? probs[i].size() / s : 0;
+        std::cout << names[i] << ": " << probs[i].size() << " windows in " << s << " s, " << windows_per_s[i] << " windows/s, "
+            << (double)count / config.sample_rate / (s > 0 ? s : 1) << "x real time" << std::endl;
+    }
+
+    float max_diff = 0;
+    for (size_t i = 0; i < probs[0].size() && i < probs[1].size(); i++)
+        max_diff = std::max(max_diff, std::abs(probs[0][i] - probs[1][i]));
+    std::cout << "speedup: " << (windows_per_s[0] > 0 ? windows_per_s[1] / windows_per_s[0] : 0)
+        << ", max probability difference: " << max_diff << std::endl;
+
+    // concurrent streams of up to a minute each, every stream on its own thread, with and without the batching service
+    const int streams = 16;
+    size_t stream_count = std::min(count, (size_t)config.sample_rate * 60);
+    int modes = 1;
+#ifdef USE_ONNX_VAD
+    int64_t window = config.windows_frame_size_ms * (config.sample_rate / 1000);
+    if (model.sessions)
+        modes = 2;
+#endif
+    for (int batched = 0; batched < modes; batched++) {
+#ifdef USE_ONNX_VAD
+        model.batcher = batched ? std::make_shared<VADBatcher>(model.sessions, config.sample_rate, window, streams) : nullptr;
+#endif
+        std::vector<std::thread> threads;
+        std::atomic<size_t> windows = 0;
+        auto t0 = std::chrono::steady_clock::now();
+        for (int i = 0; i < streams; i++) {
+            threads.emplace_back([&] {
+                VADImpl stream(model, config.sample_rate, config.windows_frame_size_ms, config.threshold, config.min_silence_duration_ms,
+                    config.speech_pad_ms, config.min_speech_duration_ms, config.max_speech_duration_s, batched != 0);
+                std::vector<float> stream_probs;
+                stream.probabilities(samples, stream_count, stream_probs);
+                windows += stream_probs.size();
+            });
+        }
+        for (auto& thread : threads)
+            thread.join();
+        double s = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+        std::cout << streams << " streams " << (batched ? "batched" : "unbatched") << ": " << windows.load() << " windows in " << s << " s, "
+            << (s > 0 ? windows.load() / s : 0) << " windows/s";
+#ifdef USE_ONNX_VAD
+        if (batched) {
+            auto stats = model.batcher->stats();
+            std::cout << ", average batch " << (stats.batches > 0 ? (double)stats.windows / stats.batches : 0);
+        }
+        model.batcher.reset();
+#endif
+        std::cout << std::endl;
+    }
+}
+
+bool validate_vad(const std::string& path, const float* samples, size_t count, VADConfig config) {
+    VADModelImpl model(path);
+    if (!model.supports(config.sample_rate)) {
+        std::cout << "the model does not support " << config.sample_rate << " Hz" << std::endl;
+        return false;
+    }
+    auto create = [&](int threads) {
+        auto vad = std::make_unique<VADImpl>(model,
+                config.sample_rate,
+                config.windows_frame_size_ms,
+                config.threshold,
+                config.min_silence_duration_ms,
+                config.speech_pad_ms,
+                config.min_speech_duration_ms,
+                config.max_speech_duration_s);
+        vad->set_parallel(threads, config.parallel_chunk_s, config.parallel_warmup_s);
+        vad->set_gate(config.energy_gate, config.energy_floor_db);
+        return vad;
+    };
+    auto detect = [&](VADImpl& vad, std::vector<speech_range>& ranges) {
+        auto t0 = std::chrono::steady_clock::now();
+        vad.start(samples, count);
+        while (vad.next())
+            ;
+        ranges = vad.ranges();
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+    };
+
+    int threads = std::max(2, config.parallel_threads);
+    std::vector<speech_range> sequential, parallel;
+    auto sequential_vad = create(1);
+    auto parallel_vad = create(threads);
+    double sequential_s = detect(*sequential_vad, sequential);
+    double parallel_s = detect(*parallel_vad, parallel);
+
+    std::cout << "sequential: " << sequential.size() << " ranges in " << sequential_s << " s" << std::endl;
+    std::cout << "parallel (" << threads << " threads, " << config.parallel_chunk_s << " s chunks, " << config.parallel_warmup_s << " s warm-up): "
+        << parallel.size() << " ranges in " << parallel_s << " s" << std::endl;
+
+    size_t mismatches = 0;
+    for (size_t i = 0; i < std::max(sequential.size(), parallel.size()); i++) {
+        bool same = i < sequential.size() && i < parallel.size() && sequential[i].start == parallel[i].start && sequential[i].end == parallel[i].end;
+        if (same)
+            continue;
+        mismatches++;
+        std::cout << "range " << i << " differs:";
+        if (i < sequential.size())
+            std::cout << " sequential " << sequential[i].start << "-" << sequential[i].end;
+        if (i < parallel.size())
+            std::cout << " parallel " << parallel[i].start << "-" << parallel[i].end;
+        std::cout << std::endl;
+    }
+    std::cout << (mismatches == 0 ? "parallel VAD matches sequential" : "parallel VAD differs from sequential") << std::endl;
+    return mismatches == 0;
+}
+
+// prints how far the window probabilities are from the reference ones
+static bool compare_probabilities(const std::vector<float>& probs, const std::vector<float>& reference, double s, float tolerance) {
+    if (reference.size() != probs.size()) {
+        std::cout << "window count differs: " << probs.size() << " computed, " << reference.size() << " in reference" << std::endl;
+        return false;
+    }
+
+    float max_diff = 0;
+    double sum_diff = 0;
+    size_t decisions = 0;   // windows on different sides of 0.5
+    for (size_t i = 0; i < probs.size(); i++) {
+        float diff = std::abs(probs[i] - reference[i]);
+        max_diff = std::max(max_diff, diff);
+        sum_diff += diff;
+        if ((probs[i] >= 0.5f) != (reference[i] >= 0.5f))
+            decisions++;
+    }
+    std::cout << probs.size() << " windows in " << s << " s (" << (s > 0 ? probs.size() / s : 0) << " windows/s), max difference " << max_diff
+        << ", mean difference " << (probs.empty() ? 0 : sum_diff / probs.size()) << ", " << decisions << " different decisions" << std::endl;
+    return max_diff <= tolerance;
+}
+
+bool vad_parity(const std::string& path, const float* samples, size_t count, int sample_rate, const std::string& reference_path, float tolerance) {
+    VADModelImpl model(path);
+    if (!model.supports(sample_rate)) {
+        std::cout << "the model does not support " << sample_rate << " Hz" << std::endl;
+        return false;
+    }
+    VADImpl vad(model, sample_rate);
+
+    std::ifstream file(reference_path, std::ios::binary);
+    std::vector<float> reference;
+    float value;
+    while (file.read((char*)&value, sizeof(value)))
+        reference.push_back(value);
+
+    std::vector<float> probs;
+    auto t0 = std::chrono::steady_clock::now();
+    vad.probabilities(samples, count, probs);
+    double s = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+
+    return compare_probabilities(probs, reference, s, tolerance);
+}
+
+bool vad_engine_parity(const std::string& path, const std::string& other_path, const float* samples, size_t count, int sample_rate, float tolerance) {
+    std::unique_ptr<VADModelImpl> model_ptr, other_ptr;
+    try {
+        model_ptr = std::make_unique<VADModelImpl>(path);
+        other_ptr = std::make_unique<VADModelImpl>(other_path);
+    } catch (const std::exception& e) {
+        // an ONNX model needs a build with USE_ONNX_VAD
+        std::cout << e.what() << std::endl;
+        return false;
+    }
+    auto& model = *model_ptr;
+    auto& other = *other_ptr;
+    if (!model.supports(sample_rate) || !other.supports(sample_rate)) {
+        std::cout << "the models do not support " << sample_rate << " Hz" << std::endl;
+        return false;
+    }
+    std::cout << path << ": " << (model.native ? "native" : "ONNX Runtime") << ", "
+        << other_path << ": " << (other.native ? "native" : "ONNX Runtime") << std::endl;
+
+    // the other model's probabilities are the reference, both run on the same samples in this process
+    VADImpl other_vad(other, sample_rate);
+    std::vector<float> reference;
+    other_vad.probabilities(samples, count, reference);
+
+    VADImpl vad(model, sample_rate);
+    std::vector<float> probs;
+    auto t0 = std::chrono::steady_clock::now();
+    vad.probabilities(samples, count, probs);
+    double s = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+
+    return compare_probabilities(probs, reference, s, tolerance);
+}
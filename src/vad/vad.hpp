@@ -2,6 +2,11 @@
 
 #include <limits>
 #include <memory>
+#include <string>
+#include <vector>
+#include <optional>
+#include <functional>
+#include <cstdint>
 
 struct speech_range {
     // size_t start;
@@ -12,28 +17,75 @@ struct speech_range {
     speech_range(int start, int end) : start(start), end(end) {}
 };
 
+// blocks until the first n samples of a growing input are available, returns the available count (less than n once the input ended)
+typedef std::function<size_t(size_t n)> SampleWait;
+
 typedef struct VADConfig {
-    int sample_rate = 16000;
+    int sample_rate = 16000;            // rate the model runs at
+    int input_sample_rate = 0;          // rate of the samples given to VAD::start() if a multiple of sample_rate (0 - sample_rate)
     int windows_frame_size_ms = 64;
     float threshold = 0.5;
     int min_silence_duration_ms = 2000; // default was 0
     int speech_pad_ms = 64;
     int min_speech_duration_ms = 64;
     float max_speech_duration_s = std::numeric_limits<float>::infinity();
+    int parallel_threads = 1;           // > 1 - speech probabilities of long inputs are computed in parallel chunks
+    float parallel_chunk_s = 60;        // duration of a parallel chunk
+    float parallel_warmup_s = 4;        // audio before each chunk that converges the model state
+    bool batched = false;               // run windows through the model's shared batching service if enabled
+    bool energy_gate = false;           // skip the model on windows below the energy floor (changes ranges around silence)
+    float energy_floor_db = -70;        // RMS floor in dBFS (peak floor is 20 dB higher)
 } VADConfig;
 
 
+// ONNX Runtime execution of a VAD model (the native engine runs on the calling threads)
+struct VADEngineConfig {
+    int intra_threads = 1;  // threads of a single model run
+    int inter_threads = 1;
+    int sessions = 0;       // sessions in the pool, i.e. concurrent runs (0 - hardware threads / intra_threads)
+};
+
+struct VADSessionStats {
+    size_t runs = 0;        // leases: streams or batches served by the session
+    double busy_s = 0;      // time the session was leased
+    double wait_s = 0;      // time leases waited for a free session
+};
+
+struct VADGateStats {
+    size_t windows = 0;     // windows seen by the energy gate
+    size_t skipped = 0;     // windows marked silent without running the model
+};
+
+struct VADBatchStats {
+    size_t batches = 0;
+    size_t windows = 0;
+};
+
+struct VADCacheStats {
+    size_t entries = 0;     // range lists kept in memory
+    size_t hits = 0;        // detections served from memory or the persistent store
+    size_t misses = 0;
+};
+
 class VADModelImpl;
 class VADImpl;
 
 class VADModel {
 public:
     VADModel();
-    VADModel(const std::string& model_path);
+    VADModel(const std::string& model_path, VADEngineConfig engine = VADEngineConfig());
     ~VADModel();
 
     operator bool() const;
     std::string error() const { return what; }
+    // 16 and 8 kHz for ONNX models, native models as converted
+    bool supports(int sample_rate) const;
+
+    // gather windows of concurrent batched VAD streams into runs of up to max_batch windows (<= 1 - disable)
+    void setBatching(int max_batch, int sample_rate = 16000, int windows_frame_size_ms = 64);
+    VADBatchStats batchStats() const;
+    VADGateStats gateStats() const;
+    std::vector<VADSessionStats> sessionStats() const;
 
 private:
     friend class VAD;
@@ -81,17 +133,66 @@ public:
     void reset();
     size_t size() const;
 
-    void start(const float* samples, size_t count);
+    // with wait, the samples are still arriving: windows are detected as soon as they are available
+    void start(const float* samples, size_t count, SampleWait wait = nullptr);
+    // 16-bit samples, converted to float one window at a time
+    void start(const int16_t* samples, size_t count, SampleWait wait = nullptr);
     void start(const std::vector<float>& samples) { start(samples.data(), samples.size()); }
+    // ends the detection early, safe to call while another thread iterates
+    void stop();
+    bool stopped() const;
+
+    // identifies the speech ranges of the samples: content hash, model and the configuration fields that affect them
+    std::string cache_key(const float* samples, size_t count) const;
+    std::string cache_key(const int16_t* samples, size_t count) const;
 
     Iterator begin();
     Iterator end();
 
+    // rate of the input samples, the speech ranges are in input samples
     int sample_rate() const { return _sample_rate; }
 
 private:
+    std::string cache_key(uint64_t hash, size_t count) const;
+
     std::unique_ptr<VADImpl> impl;
+    VADConfig config;
+    std::string model_name;
+};
+
+
+class VADRangeCacheImpl;
+
+// speech ranges of already processed audio, so that re-transcriptions of the same audio skip VAD;
+// recently used entries are kept in memory, the optional store/load callbacks persist them
+class VADRangeCache {
+public:
+    typedef std::function<bool(const std::string& key, const std::string& owner, const std::vector<speech_range>&)> Store;
+    typedef std::function<std::optional<std::vector<speech_range>>(const std::string& key)> Load;
+
+    VADRangeCache(size_t max_entries = 256);
+    ~VADRangeCache();
+
+    void setStore(Store store, Load load);
+
+    std::optional<std::vector<speech_range>> get(const std::string& key);
+    // owner - document the audio belongs to (if any)
+    void put(const std::string& key, const std::vector<speech_range>& ranges, const std::string& owner = "");
+
+    VADCacheStats stats() const;
+
+private:
+    std::unique_ptr<VADRangeCacheImpl> impl;
 };
 
 
 void test_vad_range(const std::string& path, const std::vector<float>& data, VADConfig config = VADConfig());
+// windows per second of the allocating and the bound inference loop
+void bench_vad(const std::string& path, const float* samples, size_t count, VADConfig config = VADConfig());
+// compares speech ranges of the parallel mode against the sequential one
+bool validate_vad(const std::string& path, const float* samples, size_t count, VADConfig config = VADConfig());
+// compares window probabilities of a model against reference ones (float32 file from convert_silero_vad.py --reference)
+bool vad_parity(const std::string& path, const float* samples, size_t count, int sample_rate, const std::string& reference_path, float tolerance = 1e-3f);
+// compares window probabilities of a model against another one run on the same samples in this process,
+// e.g. the native engine against the ONNX model it was converted from (requires USE_ONNX_VAD)
+bool vad_engine_parity(const std::string& path, const std::string& other_path, const float* samples, size_t count, int sample_rate, float tolerance = 1e-3f);
@@ -1,7 +1,19 @@
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <numeric>
+#include <algorithm>
+#include <functional>
+
 #include "wav_util.hpp"
+#include "simd_util.hpp"
 
 #define DR_WAV_IMPLEMENTATION
 #include <dr_wav.h>
+#define DR_FLAC_IMPLEMENTATION
+#include <dr_flac.h>
+#define DR_MP3_IMPLEMENTATION
+#include <dr_mp3.h>
 
 
 void WavBuffer::free() {
@@ -120,18 +132,284 @@ bool write_wav_file(const std::vector<float>& data, int sample_rate, std::string
     return true;
 }
 
-bool PCMBuffer::from_wav(const void* data, size_t size) {
+// zeroth order modified Bessel function of the first kind, for the Kaiser window
+static double bessel_i0(double x) {
+    double sum = 1, term = 1;
+    for (int k = 1; k < 32; k++) {
+        term *= (x / (2 * k)) * (x / (2 * k));
+        sum += term;
+    }
+    return sum;
+}
+
+Resampler::Resampler(unsigned int input_rate, unsigned int output_rate, int zero_crossings, float rolloff) {
+    size_t g = std::gcd(input_rate, output_rate);
+    up = output_rate / g;
+    down = input_rate / g;
+
+    // lowpass below the lower of both Nyquist frequencies, in cycles per sample of the upsampled signal
+    double scale = std::min(1.0, (double)up / down);
+    double cutoff = 0.5 * rolloff * scale / up;
+    size_t half = (size_t)std::ceil(zero_crossings / (rolloff * scale));
+    taps = 2 * half;
+
+    // the prototype filter is centered half input samples ahead, phase p holds taps p, p + up, p + 2 * up, ... reversed
+    const double beta = 8.6;
+    const double center = (double)half * up;
+    filters.resize(up * taps);
+    for (size_t p = 0; p < up; p++) {
+        float* filter = &filters[p * taps];
+        double sum = 0;
+        for (size_t k = 0; k < taps; k++) {
+            double t = (double)(p + k * up) - center;
+            double x = 2 * cutoff * t;
+            double sinc = t == 0 ? 1 : std::sin(M_PI * x) / (M_PI * x);
+            double r = t / (center + up);
+            double window = std::abs(r) < 1 ? bessel_i0(beta * std::sqrt(1 - r * r)) / bessel_i0(beta) : 0;
+            double h = 2 * cutoff * up * sinc * window;
+            filter[taps - 1 - k] = (float)h;
+            sum += h;
+        }
+        // unity gain in every phase
+        for (size_t k = 0; k < taps; k++)
+            filter[k] = (float)(filter[k] / sum);
+    }
+
+    // silence before the first input sample
+    history.assign(taps, 0.0f);
+    base = -(int64_t)taps;
+    next_input = 0;
+}
+
+// output n needs input samples next_input + half - taps + 1 .. next_input + half
+size_t Resampler::produce(float* output, size_t capacity, size_t limit) {
+    size_t half = taps / 2;
+    size_t n = 0;
+    while (n < capacity && produced < limit && (int64_t)(next_input + half) < base + (int64_t)history.size()) {
+        size_t first = (size_t)((int64_t)(next_input + half + 1 - taps) - base);
+        output[n++] = dot(&filters[next_phase * taps], &history[first], taps);
+        produced++;
+        next_phase += down;
+        next_input += next_phase / up;
+        next_phase %= up;
+    }
+
+    // drop input no longer needed by the next output
+    int64_t keep = (int64_t)(next_input + half + 1) - (int64_t)taps;
+    if (keep > base) {
+        size_t drop = std::min((size_t)(keep - base), history.size());
+        history.erase(history.begin(), history.begin() + drop);
+        base += drop;
+    }
+    return n;
+}
+
+size_t Resampler::process(const float* input, size_t count, float* output, size_t capacity) {
+    history.insert(history.end(), input, input + count);
+    consumed += count;
+    return produce(output, capacity, output_count(consumed));
+}
+
+size_t Resampler::flush(float* output, size_t capacity) {
+    // silence after the last input sample
+    history.insert(history.end(), taps, 0.0f);
+    return produce(output, capacity, output_count(consumed));
+}
+
+AudioFormat detect_audio_format(const void* data, size_t size) {
+    const uint8_t* b = (const uint8_t*)data;
+    if (size < 12)
+        return AudioFormat::Unknown;
+    if ((std::memcmp(b, "RIFF", 4) == 0 || std::memcmp(b, "RIFX", 4) == 0 || std::memcmp(b, "RF64", 4) == 0) && std::memcmp(b + 8, "WAVE", 4) == 0)
+        return AudioFormat::WAV;
+    if (std::memcmp(b, "riff", 4) == 0 || (std::memcmp(b, "FORM", 4) == 0 && (std::memcmp(b + 8, "AIFF", 4) == 0 || std::memcmp(b + 8, "AIFC", 4) == 0)))
+        return AudioFormat::WAV;    // Wave64 and AIFF, also read by dr_wav
+    if (std::memcmp(b, "fLaC", 4) == 0)
+        return AudioFormat::FLAC;
+    if (std::memcmp(b, "OggS", 4) == 0) {
+        // the first page carries the stream's mapping header: 0x7F "FLAC" for Ogg FLAC, Vorbis and Opus can't be decoded
+        size_t header = 27 + (size > 26 ? b[26] : 0);  // page header and its segment table
+        if (size >= header + 5 && b[header] == 0x7F && std::memcmp(b + header + 1, "FLAC", 4) == 0)
+            return AudioFormat::Ogg;
+        return AudioFormat::Unknown;
+    }
+    // ID3v2 tag or an MPEG audio frame sync
+    if (std::memcmp(b, "ID3", 3) == 0 || (b[0] == 0xFF && (b[1] & 0xE0) == 0xE0))
+        return AudioFormat::MP3;
+    return AudioFormat::Unknown;
+}
+
+const char* audio_format_extension(AudioFormat format) {
+    switch (format) {
+        case AudioFormat::WAV: return ".wav";
+        case AudioFormat::FLAC: return ".flac";
+        case AudioFormat::MP3: return ".mp3";
+        case AudioFormat::Ogg: return ".ogg";
+        default: return "";
+    }
+}
+
+const char* audio_format_mime_type(AudioFormat format) {
+    switch (format) {
+        case AudioFormat::WAV: return "audio/wav";
+        case AudioFormat::FLAC: return "audio/flac";
+        case AudioFormat::MP3: return "audio/mpeg";
+        case AudioFormat::Ogg: return "audio/ogg";
+        default: return "application/octet-stream";
+    }
+}
+
+// interleaved float frames of an opened decoder, read block by block
+struct AudioDecoder {
+    unsigned int channels = 0;
+    unsigned int sample_rate = 0;
+    size_t frames = 0;  // 0 - unknown before decoding (MP3)
+    std::function<size_t(size_t, float*)> read;
+    std::shared_ptr<void> handle;
+
+    bool open(AudioFormat format, const void* data, size_t size) {
+        switch (format) {
+            case AudioFormat::WAV: {
+                // the decoders keep a pointer to themselves, so they live on the heap
+                auto wav = std::make_unique<drwav>();
+                if (!drwav_init_memory(wav.get(), data, size, nullptr))
+                    return false;
+                channels = wav->channels;
+                sample_rate = wav->sampleRate;
+                frames = wav->totalPCMFrameCount;
+                read = [wav = wav.get()](size_t n, float* out) { return (size_t)drwav_read_pcm_frames_f32(wav, n, out); };
+                handle = std::shared_ptr<drwav>(wav.release(), [](drwav* wav) { drwav_uninit(wav); delete wav; });
+                return true;
+            }
+            case AudioFormat::FLAC:
+            case AudioFormat::Ogg: {
+                // dr_flac also reads FLAC in an Ogg container, Vorbis and Opus are not supported
+                auto flac = std::shared_ptr<drflac>(drflac_open_memory(data, size, nullptr), [](drflac* flac) { if (flac) drflac_close(flac); });
+                if (!flac)
+                    return false;
+                channels = flac->channels;
+                sample_rate = flac->sampleRate;
+                frames = flac->totalPCMFrameCount;
+                read = [flac = flac.get()](size_t n, float* out) { return (size_t)drflac_read_pcm_frames_f32(flac, n, out); };
+                handle = flac;
+                return true;
+            }
+            case AudioFormat::MP3: {
+                auto mp3 = std::make_unique<drmp3>();
+                if (!drmp3_init_memory(mp3.get(), data, size, nullptr))
+                    return false;
+                channels = mp3->channels;
+                sample_rate = mp3->sampleRate;
+                read = [mp3 = mp3.get()](size_t n, float* out) { return (size_t)drmp3_read_pcm_frames_f32(mp3, n, out); };
+                handle = std::shared_ptr<drmp3>(mp3.release(), [](drmp3* mp3) { drmp3_uninit(mp3); delete mp3; });
+                return true;
+            }
+            default:
+                return false;
+        }
+    }
+};
+
+bool PCMBuffer::from_wav(const void* data, size_t size, unsigned int sample_rate) {
 
     free();
 
-    drwav_uint64 total_frame_count = 0;
+    AudioFormat format = detect_audio_format(data, size);
+
+    AudioDecoder decoder;
+
+    // unrecognized input is left to dr_wav, as before
+    if (!decoder.open(format == AudioFormat::Unknown ? AudioFormat::WAV : format, data, size))
+        return false;
+
+    _format = format == AudioFormat::Unknown ? AudioFormat::WAV : format;
+    _source_channels = decoder.channels;
+    _source_sample_rate = decoder.sample_rate;
+
+    if (decoder.channels == 0 || !supported_sample_rate(decoder.sample_rate))
+        return false;
+
+    if (sample_rate == 0)
+        sample_rate = decoder.sample_rate;
+
+    unsigned int channels = decoder.channels;
+
+    // read, downmix and resample block by block, the full rate input is never held in memory;
+    // the output is released with drwav_free(), which falls back to free()
+    std::unique_ptr<Resampler> resampler = sample_rate != decoder.sample_rate ? std::make_unique<Resampler>(decoder.sample_rate, sample_rate) : nullptr;
+    const size_t block_frames = 4096;
+    size_t capacity = 0;
+    size_t consumed = 0;
+
+    // known lengths are allocated once, streams of unknown length grow geometrically
+    const auto reserve = [&](size_t needed) {
+        if (needed <= capacity)
+            return true;
+        size_t grown = decoder.frames > 0 ? needed : std::max(needed, 2 * capacity);
+        float* samples = (float*)std::realloc(_samples, grown * sizeof(float));
+        if (!samples)
+            return false;
+        _samples = samples;
+        capacity = grown;
+        return true;
+    };
+
+    const auto output_count = [&](size_t frames) { return resampler ? resampler->output_count(frames) : frames; };
+
+    if (decoder.frames > 0 && !reserve(output_count(decoder.frames))) {
+        free();
+        return false;
+    }
+
+    std::vector<float> block(block_frames * channels);
+    std::vector<float> mono(channels > 1 ? block_frames : 0);
+
+    while (true) {
+        size_t want = decoder.frames > 0 ? std::min(block_frames, decoder.frames - consumed) : block_frames;
+        if (want == 0 || !reserve(output_count(consumed + want)))
+            break;
+        float* out = channels > 1 || resampler ? block.data() : _samples + _count;
+        size_t n = decoder.read(want, out);
+        if (n == 0)
+            break;
+        consumed += n;
+        const float* input = out;
+        if (channels > 1) {
+            const float gain = 1.0f / channels;
+            for (size_t i = 0; i < n; i++) {
+                float sum = 0;
+                for (unsigned int c = 0; c < channels; c++)
+                    sum += block[i * channels + c];
+                mono[i] = sum * gain;
+            }
+            input = mono.data();
+        }
+        if (resampler)
+            _count += resampler->process(input, n, _samples + _count, capacity - _count);
+        else {
+            if (input != _samples + _count)
+                std::memcpy(_samples + _count, input, n * sizeof(float));
+            _count += n;
+        }
+    }
 
-    _samples = drwav_open_memory_and_read_pcm_frames_f32(data, size, &_channels, &_sample_rate, &total_frame_count, nullptr);
+    if (resampler && reserve(output_count(consumed)))
+        _count += resampler->flush(_samples + _count, capacity - _count);
 
-    if(!_samples)
+    if (!_samples || _count == 0) {
+        free();
         return false;
+    }
+
+    // return the spare capacity of streams with unknown length
+    if (capacity > _count) {
+        if (float* samples = (float*)std::realloc(_samples, _count * sizeof(float)); samples)
+            _samples = samples;
+    }
 
-    _count = (int)total_frame_count;
+    _owner = true;
+    _channels = 1;
+    _sample_rate = sample_rate;
 
     return true;
 }
@@ -148,13 +426,251 @@ void PCMBuffer::free() {
 
 SharedBuffer<float> PCMBuffer::share() {
     if (_samples && _owner) {
-        return std::move(SharedBuffer(_samples, _count, &drwav_free));
         _owner = false;
+        return SharedBuffer<float>(_samples, [](float* samples) { drwav_free(samples, nullptr); }, _count);
     }
     return std::move(SharedBuffer(_samples, _count, false));
 }
 
 
+static uint16_t read_le16(const uint8_t* p) { return p[0] | (p[1] << 8); }
+static uint32_t read_le32(const uint8_t* p) { return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24); }
+
+bool PCMStream::write(const void* data, size_t size) {
+    if (_mode == Mode::Failed)
+        return false;
+
+    if (_mode == Mode::Stream && frames_left == 0)
+        return true;    // chunks after the audio data
+
+    pending.insert(pending.end(), (const uint8_t*)data, (const uint8_t*)data + size);
+
+    if (_mode == Mode::Header && !parse_header()) {
+        _mode = Mode::Failed;
+        return false;
+    }
+
+    if (_mode == Mode::Stream && !convert()) {
+        _mode = Mode::Failed;
+        return false;
+    }
+
+    return true;
+}
+
+// RIFF chunks up to the data chunk, inputs that can't be streamed are left to be decoded as a whole
+bool PCMStream::parse_header() {
+    if (pending.size() < 12)
+        return true;
+
+    _format = detect_audio_format(pending.data(), pending.size());
+    if (_format == AudioFormat::Unknown) {
+        // unrecognized input is left to dr_wav, as in PCMBuffer
+        _mode = Mode::Buffer;
+        return true;
+    }
+    if (_format != AudioFormat::WAV || std::memcmp(pending.data(), "RIFF", 4) != 0) {
+        _mode = Mode::Buffer;
+        return true;
+    }
+
+    const uint8_t* b = pending.data();
+    unsigned int channels = 0;
+    unsigned int rate = 0;
+    size_t pos = 12;
+
+    while (pos + 8 <= pending.size()) {
+        uint32_t size = read_le32(b + pos + 4);
+        if (std::memcmp(b + pos, "data", 4) == 0) {
+            // RIFF written before its length was known has no usable data size
+            if (channels == 0 || size < block_align || size == 0xFFFFFFFF) {
+                _mode = Mode::Buffer;
+                return true;
+            }
+            frames_left = size / block_align;
+            pending.erase(pending.begin(), pending.begin() + pos + 8);
+            break;
+        }
+        if (pos + 8 + size > pending.size())
+            return true;    // wait for the whole chunk
+        if (std::memcmp(b + pos, "fmt ", 4) == 0) {
+            if (size < 16) {
+                _mode = Mode::Buffer;
+                return true;
+            }
+            const uint8_t* fmt = b + pos + 8;
+            tag = read_le16(fmt);
+            channels = read_le16(fmt + 2);
+            rate = read_le32(fmt + 4);
+            block_align = read_le16(fmt + 12);
+            bits = read_le16(fmt + 14);
+            if (tag == 0xFFFE && size >= 26)
+                tag = read_le16(fmt + 24);     // WAVE_FORMAT_EXTENSIBLE sub-format
+            bool supported = (tag == 1 && (bits == 8 || bits == 16 || bits == 24 || bits == 32)) || (tag == 3 && bits == 32);
+            if (!supported || channels == 0 || rate == 0 || block_align != channels * bits / 8) {
+                _mode = Mode::Buffer;
+                return true;
+            }
+        }
+        pos += 8 + size + (size & 1);
+    }
+
+    if (frames_left == 0)
+        return true;
+
+    _source_channels = channels;
+    _source_sample_rate = rate;
+    if (!supported_sample_rate(rate))
+        return false;
+    if (_sample_rate == 0)
+        _sample_rate = rate;
+    if (_sample_rate != rate)
+        resampler = std::make_unique<Resampler>(rate, _sample_rate);
+
+    // allocated once, so that the readers may keep the pointer
+    _count = resampler ? resampler->output_count(frames_left) : frames_left;
+    _samples = (float*)std::malloc(_count * sizeof(float));
+    if (!_samples) {
+        _count = 0;
+        return false;
+    }
+    _owner = true;
+    _mode = Mode::Stream;
+    return true;
+}
+
+// complete frames of the pending input into samples
+bool PCMStream::convert() {
+    const size_t block_frames = 4096;
+    const unsigned int channels = _source_channels;
+    size_t offset = 0;
+
+    while (frames_left > 0) {
+        size_t n = std::min({ (pending.size() - offset) / block_align, frames_left, block_frames });
+        if (n == 0)
+            break;
+        const uint8_t* in = pending.data() + offset;
+        block.resize(n * channels);
+        if (tag == 3)
+            std::memcpy(block.data(), in, n * block_align);
+        else if (bits == 8)
+            drwav_u8_to_f32(block.data(), in, n * channels);
+        else if (bits == 16)
+            drwav_s16_to_f32(block.data(), (const drwav_int16*)in, n * channels);
+        else if (bits == 24)
+            drwav_s24_to_f32(block.data(), in, n * channels);
+        else
+            drwav_s32_to_f32(block.data(), (const drwav_int32*)in, n * channels);
+        offset += n * block_align;
+        frames_left -= n;
+
+        const float* input = block.data();
+        if (channels > 1) {
+            mono.resize(n);
+            const float gain = 1.0f / channels;
+            for (size_t i = 0; i < n; i++) {
+                float sum = 0;
+                for (unsigned int c = 0; c < channels; c++)
+                    sum += block[i * channels + c];
+                mono[i] = sum * gain;
+            }
+            input = mono.data();
+        }
+        if (resampler)
+            written += resampler->process(input, n, _samples + written, _count - written);
+        else {
+            n = std::min(n, _count - written);
+            std::memcpy(_samples + written, input, n * sizeof(float));
+            written += n;
+        }
+    }
+
+    // the remainder of an incomplete frame stays for the next block
+    pending.erase(pending.begin(), pending.begin() + offset);
+
+    publish(written);
+    return true;
+}
+
+void PCMStream::publish(size_t written) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        _available = written;
+    }
+    cv.notify_all();
+}
+
+bool PCMStream::finish() {
+    if (_mode == Mode::Header && !pending.empty())
+        _mode = Mode::Buffer;
+
+    if (_mode == Mode::Stream) {
+        if (resampler)
+            written += resampler->flush(_samples + written, _count - written);
+        // an incomplete input ends early
+        _count = written;
+    } else if (_mode == Mode::Buffer) {
+        bool ok = decoded.from_wav(pending.data(), pending.size(), _sample_rate);
+        // kept on failure, so that a rejected sample rate can be told from undecodable input
+        _source_sample_rate = decoded.source_sample_rate();
+        if (ok) {
+            _format = decoded.format();
+            _source_channels = decoded.source_channels();
+            _sample_rate = decoded.sample_rate();
+            _samples = (float*)decoded.samples();
+            _count = decoded.count();
+            _owner = false;
+        }
+    }
+    std::vector<uint8_t>().swap(pending);
+    resampler.reset();
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        _available = _count;
+        _finished = true;
+    }
+    cv.notify_all();
+
+    return _samples != nullptr && _count > 0;
+}
+
+bool PCMStream::finished() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return _finished;
+}
+
+size_t PCMStream::wait(size_t n) {
+    std::unique_lock<std::mutex> lock(mutex);
+    cv.wait(lock, [&] { return _finished || _available >= n; });
+    return _available;
+}
+
+size_t PCMStream::available() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return _available;
+}
+
+void PCMStream::free() {
+    if (_samples && _owner)
+        std::free(_samples);
+    decoded.free();
+    _samples = nullptr;
+    _count = 0;
+    _owner = false;
+}
+
+SharedBuffer<float> PCMStream::share() {
+    if (_mode == Mode::Buffer)
+        return decoded.share();
+    if (_samples && _owner) {
+        _owner = false;
+        return SharedBuffer<float>(_samples, [](float* samples) { std::free(samples); }, count());
+    }
+    return SharedBuffer<float>(_samples, count(), false);
+}
+
+
 std::string base64_encode(const WavBuffer& data) {
     return base64_encode((const uint8_t*)data.data(), data.size());
 }
@@ -3,6 +3,10 @@
 #include <string>
 #include <vector>
 #include <memory>
+#include <cstdint>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
 
 #include "util.hpp"
 
@@ -32,10 +36,58 @@ private:
     size_t _size = 0;
 };
 
+enum class AudioFormat {
+    Unknown,
+    WAV,    // also Wave64 and AIFF
+    FLAC,
+    MP3,
+    Ogg,    // Ogg FLAC only, other Ogg streams are Unknown
+};
+
+// container of encoded audio by its magic bytes
+AudioFormat detect_audio_format(const void* data, size_t size);
+const char* audio_format_extension(AudioFormat format);
+const char* audio_format_mime_type(AudioFormat format);
+
+// source sample rates accepted from uploaded headers, others are rejected before resampling
+constexpr unsigned int min_source_sample_rate = 4000;
+constexpr unsigned int max_source_sample_rate = 384000;
+inline bool supported_sample_rate(unsigned int rate) { return rate >= min_source_sample_rate && rate <= max_source_sample_rate; }
+
+// Streaming polyphase windowed-sinc resampler of mono audio between integer sample rates,
+// the input is fed in blocks of any size and only zero_crossings * 2 input samples of history are kept
+class Resampler {
+public:
+    Resampler(unsigned int input_rate, unsigned int output_rate, int zero_crossings = 16, float rolloff = 0.95f);
+
+    // resamples the next block, writes at most capacity samples and returns their count
+    size_t process(const float* input, size_t count, float* output, size_t capacity);
+    // the remaining output after the last block
+    size_t flush(float* output, size_t capacity);
+
+    // output samples of input_count input samples
+    size_t output_count(size_t input_count) const { return (input_count * up + down - 1) / down; }
+
+private:
+    size_t produce(float* output, size_t capacity, size_t limit);
+
+    size_t up;                      // output_rate / gcd
+    size_t down;                    // input_rate / gcd
+    size_t taps;                    // filter taps per phase
+    std::vector<float> filters;     // [up][taps], reversed, so that each output is a single dot product
+    std::vector<float> history;     // input samples, history[0] is input sample base
+    int64_t base;
+    size_t next_input = 0;          // input sample of the next output
+    size_t next_phase = 0;
+    size_t consumed = 0;            // input samples fed
+    size_t produced = 0;            // output samples written
+};
+
 class PCMBuffer {
 public:
     PCMBuffer() {}
-    PCMBuffer(const void* data, size_t size) { from_wav(data, size); }
+    // WAV, FLAC or MP3 input, other than sample_rate mono is downmixed and resampled (sample_rate 0 - only downmix)
+    PCMBuffer(const void* data, size_t size, unsigned int sample_rate = 16000) { from_wav(data, size, sample_rate); }
     ~PCMBuffer() { free(); }
     // no copying
     PCMBuffer(const PCMBuffer&) = delete;
@@ -43,23 +95,98 @@ public:
     // only moving allowed
     PCMBuffer(PCMBuffer&&) noexcept = default;
     PCMBuffer& operator=(PCMBuffer&&) noexcept = default;
-    bool from_wav(const void* data, size_t size);
-    bool from_wav(const std::vector<uint8_t>& data) { return from_wav(data.data(), data.size()); }
+    bool from_wav(const void* data, size_t size, unsigned int sample_rate = 16000);
+    bool from_wav(const std::vector<uint8_t>& data, unsigned int sample_rate = 16000) { return from_wav(data.data(), data.size(), sample_rate); }
     void free();
     operator bool() const { return _samples != nullptr && _count > 0; }
     const float* samples() const { return _samples; }
     size_t count() const { return _count; }
     unsigned int channels() const { return _channels; }
     unsigned int sample_rate() const { return _sample_rate; }
+    // format of the decoded input before conversion
+    unsigned int source_channels() const { return _source_channels; }
+    unsigned int source_sample_rate() const { return _source_sample_rate; }
+    AudioFormat format() const { return _format; }
     SharedBuffer<float> share();
 private:
     float* _samples = nullptr;;
     size_t _count = 0;
     unsigned int _channels = 0;
     unsigned int _sample_rate = 0;
+    unsigned int _source_channels = 0;
+    unsigned int _source_sample_rate = 0;
+    AudioFormat _format = AudioFormat::Unknown;
     bool _owner = true;
 };
 
+// Mono samples of audio received in blocks of any size (e.g., an upload while it arrives). PCM and float WAV frames
+// are converted as soon as they are complete into a buffer allocated once from the data chunk size, other inputs
+// (FLAC, MP3, WAV of unknown length) are kept encoded and decoded by finish(). Written by a single thread,
+// other threads may read the samples up to available() once streaming() is true.
+class PCMStream {
+public:
+    PCMStream(unsigned int sample_rate = 16000) : _sample_rate(sample_rate) {}
+    ~PCMStream() { free(); }
+    PCMStream(const PCMStream&) = delete;
+    PCMStream& operator=(const PCMStream&) = delete;
+
+    // false on input that can't be decoded
+    bool write(const void* data, size_t size);
+    // end of the input (also an incomplete one), wakes up the waiting readers
+    bool finish();
+    void free();
+
+    // the samples pointer and the expected count are final, the samples arrive progressively
+    bool streaming() const { return _mode == Mode::Stream; }
+    bool finished() const;
+    // blocks until the first n samples are available, returns the available count (less than n once the input ended)
+    size_t wait(size_t n);
+    size_t available() const;
+
+    operator bool() const { return _samples != nullptr && _count > 0; }
+    const float* samples() const { return _samples; }
+    // expected count while streaming, the decoded count after finish()
+    size_t count() const { return _count; }
+    unsigned int sample_rate() const { return _sample_rate; }
+    unsigned int source_channels() const { return _source_channels; }
+    unsigned int source_sample_rate() const { return _source_sample_rate; }
+    AudioFormat format() const { return _format; }
+    // after finish()
+    SharedBuffer<float> share();
+
+private:
+    enum class Mode { Header, Stream, Buffer, Failed };
+
+    bool parse_header();
+    bool convert();
+    void publish(size_t written);
+
+    Mode _mode = Mode::Header;
+    std::vector<uint8_t> pending;   // encoded input not converted yet
+    std::unique_ptr<Resampler> resampler;
+    std::vector<float> block;
+    std::vector<float> mono;
+    PCMBuffer decoded;              // input decoded as a whole by finish()
+    uint16_t tag = 0;
+    uint16_t bits = 0;
+    uint16_t block_align = 0;
+    size_t frames_left = 0;
+    size_t written = 0;
+
+    float* _samples = nullptr;
+    std::atomic<size_t> _count = 0;     // shrinks in finish() of an incomplete input while readers are streaming
+    unsigned int _sample_rate = 16000;
+    unsigned int _source_channels = 0;
+    unsigned int _source_sample_rate = 0;
+    AudioFormat _format = AudioFormat::Unknown;
+    bool _owner = false;
+
+    mutable std::mutex mutex;
+    std::condition_variable cv;
+    size_t _available = 0;
+    bool _finished = false;
+};
+
 std::vector<int16_t> buffer_f32_to_s16(const std::vector<float>& input);
 std::vector<float> buffer_s16_to_f32(const std::vector<int16_t>& input);
 std::unique_ptr<WavBuffer> make_wav_buffer(const std::vector<float>& data, int sample_rate, int channels = 1);
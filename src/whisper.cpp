@@ -2,6 +2,7 @@
 #include <iostream>
 #include <memory>
 #include <queue>
+#include <deque>
 #include <mutex>
 #include <map>
 #include <thread>
@@ -11,18 +12,31 @@
 #include <unordered_map>
 #include <shared_mutex>
 #include <atomic>
+#include <vector>
+#include <chrono>
+#include <condition_variable>
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+#include <fstream>
+#include <filesystem>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
 
 #include <whisper.h>
 #include <nlohmann/json.hpp>
 
 #include "whisper.hpp"
 #include "wav_util.hpp"
+#include "simd_util.hpp"
 #include "vad/vad.hpp"
 #include "random-generator.hpp"
 #include "callback-manager.hpp"
+#include "blocking-queue.hpp"
 #include "log.hpp"
 #include "optional-ref.hpp"
-#include "ref-keeper.hpp"
 
 using json = nlohmann::json;
 
@@ -50,6 +64,125 @@ __attribute__((visibility("hidden"))) __attribute__((weak)) ggml_backend_reg_t g
 
 class WhisperImpl;
 
+struct whisper_state_deleter {
+    void operator()(struct whisper_state *state) const {
+        if (state != nullptr) {
+            whisper_free_state(state);
+        }
+    }
+};
+
+
+// bounded pool of warm whisper states shared by all users of the same model context
+class WhisperStatePool : public std::enable_shared_from_this<WhisperStatePool> {
+    inline static logger log = new_logger("whisper-states");
+public:
+    WhisperStatePool(struct whisper_context *ctx) : ctx(ctx) {}
+    ~WhisperStatePool() {
+        for (auto state : idle)
+            whisper_free_state(state);
+    }
+
+    // max_states <= 0 means unlimited
+    void configure(int max_states) {
+        std::lock_guard<std::mutex> lock(mutex);
+        this->max_states = max_states;
+        // drop idle states above the new limit
+        while (max_states > 0 && !idle.empty() && in_use + (int)idle.size() > max_states) {
+            whisper_free_state(idle.back());
+            idle.pop_back();
+        }
+        cv.notify_all();
+    }
+
+    // allocate states upfront, so that the first requests do not pay for initialization
+    void prewarm(int n) {
+        std::vector<std::shared_ptr<struct whisper_state>> states;
+        for (int i = 0; i < n; i++) {
+            if (auto state = acquire(0); state)
+                states.push_back(std::move(state));
+            else
+                break;
+        }
+        log.debug("prewarmed {} whisper state(s)", states.size());
+        // states are returned to the pool here
+    }
+
+    // check out a state, wait_ms < 0 waits until one is available, 0 fails immediately when the pool is exhausted;
+    // the state is returned to the pool when the last reference is released
+    std::shared_ptr<struct whisper_state> acquire(int wait_ms = -1) {
+        struct whisper_state *state = nullptr;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            auto available = [this] { return !idle.empty() || max_states <= 0 || in_use + (int)idle.size() < max_states; };
+            if (wait_ms < 0) {
+                cv.wait(lock, available);
+            } else if (!cv.wait_for(lock, std::chrono::milliseconds(wait_ms), available)) {
+                log.warn("no free whisper state available ({} in use)", in_use);
+                return nullptr;
+            }
+            if (!idle.empty()) {
+                state = idle.back();
+                idle.pop_back();
+            }
+            in_use++;  // reserve the slot before possibly initializing a new state outside the lock
+        }
+
+        if (state == nullptr) {
+            log.debug("initializing new whisper state");
+            state = whisper_init_state(ctx);
+            if (state == nullptr) {
+                log.error("failed to initialize whisper state");
+                release(nullptr);
+                return nullptr;
+            }
+        }
+
+        std::weak_ptr<WhisperStatePool> pool = weak_from_this();
+        return std::shared_ptr<struct whisper_state>(state, [pool](struct whisper_state *state) {
+            if (auto p = pool.lock())
+                p->release(state);
+            else
+                whisper_state_deleter()(state);
+        });
+    }
+
+    // do not return this state to the pool (e.g., after an error)
+    void discard(struct whisper_state *state) {
+        std::lock_guard<std::mutex> lock(mutex);
+        discarded.push_back(state);
+    }
+
+private:
+    void release(struct whisper_state *state) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            in_use--;
+            if (state != nullptr) {
+                auto it = std::find(discarded.begin(), discarded.end(), state);
+                if (it != discarded.end()) {
+                    discarded.erase(it);
+                    whisper_free_state(state);
+                } else if (max_states > 0 && in_use + (int)idle.size() >= max_states) {
+                    whisper_free_state(state);  // pool was shrunk meanwhile
+                } else {
+                    idle.push_back(state);
+                }
+            }
+        }
+        cv.notify_one();
+    }
+
+    struct whisper_context *ctx = nullptr;
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::vector<struct whisper_state *> idle;
+    std::vector<struct whisper_state *> discarded;
+    int in_use = 0;
+    int max_states = 0;
+};
+
+
 class WhisperModelImpl {
 public:
     WhisperModelImpl() {}
@@ -106,39 +239,161 @@ public:
         }
         dtw_enabled = cparams.dtw_token_timestamps;
         ctx = whisper_init_from_file_with_params_no_state(model.c_str(), cparams);
-        if (ctx != nullptr)
+        if (ctx != nullptr) {
             eot = whisper_token_eot(ctx);
+            states = std::make_shared<WhisperStatePool>(ctx);
+        }
         return ctx != nullptr;
     }
 
     void free() {
+        states = nullptr;  // idle states must be freed before the context
         if (ctx != nullptr)
             whisper_free(ctx);
         ctx = nullptr;
     }
 
+    void configureStatePool(int max_states, int prewarm = 0) {
+        if (!states)
+            return;
+        states->configure(max_states);
+        if (prewarm > 0)
+            states->prewarm(max_states > 0 ? std::min(prewarm, max_states) : prewarm);
+    }
+
     static std::string system_info() { return whisper_print_system_info(); }
 private:
     friend class WhisperImpl;
     // struct whisper_context * context() { return ctx; }
     struct whisper_context *ctx = nullptr;
+    std::shared_ptr<WhisperStatePool> states;
     bool dtw_enabled = false;
     whisper_token eot;
 };
 
-struct whisper_state_deleter {
-    void operator()(struct whisper_state *state) const {
-        if (state != nullptr) {
-            whisper_free_state(state);
+
+// consecutive VAD speech ranges packed into a single whisper window, since whisper pads every input to 30 s anyway
+struct SpeechWindow {
+    struct Piece {
+        size_t src;     // first sample in the source audio
+        size_t dst;     // first sample in the packed window
+        size_t size;
+    };
+
+    std::vector<Piece> pieces;
+    int sample_rate = 16000;
+    int ranges = 0;     // number of speech ranges packed
+
+    SpeechWindow(int sample_rate = 16000) : sample_rate(sample_rate) {}
+    SpeechWindow(const speech_range& sr, int sample_rate) : sample_rate(sample_rate) { append(sr.start, sr.end - sr.start); ranges = 1; }
+
+    bool empty() const { return pieces.empty(); }
+    bool contiguous() const { return pieces.size() <= 1; }
+    size_t size() const { return pieces.empty() ? 0 : pieces.back().dst + pieces.back().size; }
+    size_t start() const { return pieces.empty() ? 0 : pieces.front().src; }
+    size_t end() const { return pieces.empty() ? 0 : pieces.back().src + pieces.back().size; }
+
+    void append(size_t src, size_t size) {
+        if (size == 0)
+            return;
+        if (!pieces.empty() && pieces.back().src + pieces.back().size == src)
+            pieces.back().size += size;
+        else
+            pieces.push_back({ src, this->size(), size });
+    }
+
+    // window samples, pieces are copied into the buffer only if the window is not contiguous
+    const float* data(const float* samples, std::vector<float>& buffer) const {
+        if (contiguous())
+            return &samples[start()];
+        buffer.resize(size());
+        for (auto& piece : pieces)
+            std::copy(&samples[piece.src], &samples[piece.src + piece.size], &buffer[piece.dst]);
+        return buffer.data();
+    }
+
+    // 16-bit samples are always converted into the buffer
+    const float* data(const int16_t* samples, std::vector<float>& buffer) const {
+        buffer.resize(size());
+        for (auto& piece : pieces)
+            s16_to_f32(&samples[piece.src], &buffer[piece.dst], piece.size);
+        return buffer.data();
+    }
+
+    // map whisper time (in 10 ms units) within the window to time within the source audio
+    int64_t map(int64_t t) const {
+        if (pieces.empty())
+            return t;
+        int64_t pos = t * sample_rate / 100;
+        auto it = std::upper_bound(pieces.begin(), pieces.end(), pos, [](int64_t pos, const Piece& piece) { return pos < (int64_t)piece.dst; });
+        const Piece& piece = it == pieces.begin() ? pieces.front() : *(it - 1);
+        return t + (int64_t)(piece.src - piece.dst) * 100 / sample_rate;
+    }
+};
+
+class SpeechWindowPacker {
+public:
+    // silence longer than max_gap_ms is never packed into one window (so that the context reset still happens)
+    SpeechWindowPacker(int sample_rate, int window_ms, int gap_ms, int max_gap_ms) : window(sample_rate), sample_rate(sample_rate),
+        window_samples((size_t)window_ms * sample_rate / 1000), gap_samples((size_t)gap_ms * sample_rate / 1000),
+        max_gap_samples((size_t)max_gap_ms * sample_rate / 1000) {}
+
+    // returns the current window, if the speech range does not fit into it anymore
+    std::optional<SpeechWindow> add(const speech_range& sr) {
+        std::optional<SpeechWindow> full;
+        size_t size = sr.end - sr.start;
+
+        if (!window.empty()) {
+            size_t gap = sr.start > prev_end ? sr.start - prev_end : 0;
+            size_t kept = std::min(gap, gap_samples);
+            if (gap > max_gap_samples || window.size() + kept + size > window_samples) {
+                full = std::move(window);
+                window = SpeechWindow(sample_rate);
+            } else {
+                // shorten the silence between ranges, keep half of it after the previous range and half before the next one
+                size_t before = kept / 2;
+                window.append(prev_end, before);
+                window.append(sr.start - (kept - before), kept - before);
+            }
         }
+
+        window.append(sr.start, size);
+        window.ranges++;
+        prev_end = sr.end;
+
+        return full;
     }
+
+    std::optional<SpeechWindow> flush() {
+        if (window.empty())
+            return std::nullopt;
+        std::optional<SpeechWindow> last = std::move(window);
+        window = SpeechWindow(sample_rate);
+        return last;
+    }
+
+private:
+    SpeechWindow window;
+    int sample_rate;
+    size_t window_samples;
+    size_t gap_samples;
+    size_t max_gap_samples;
+    size_t prev_end = 0;
 };
 
 
+// progress of a preempted transcription, enough to resume it later with any state
+struct WhisperProgress {
+    size_t resume_sample = 0;           // VAD restarts from here, everything before is already transcribed
+    std::vector<whisper_token> prompt;  // text context for the next window
+    std::string lang;                   // detected language
+};
+
 class WhisperImpl {
     inline static logger log = new_logger("whisper");
     WhisperModelImpl& model;
     VADModel vad_model;
+    std::shared_ptr<VADRangeCache> vad_cache;
     // struct whisper_state *state = nullptr;
     std::shared_ptr<struct whisper_state> state;
     CStyleCallbackManager<void, struct whisper_context *, struct whisper_state *, int> newSegmentCallbacks;
@@ -157,7 +412,11 @@ public:
         // state.reset(nullptr);
     }
 
+    // return the state to the pool, results are no longer accessible afterwards
+    void release() { state = nullptr; }
+
     void setVADModel(VADModel& vad_model) { this->vad_model = vad_model; }
+    void setVADCache(std::shared_ptr<VADRangeCache> cache) { vad_cache = cache; }
 
     // TODO: forward callback
     WhisperReturnValue operator()(const void* wav_data, size_t wav_size, const WhisperJobConfig& config = WhisperJobConfig()) {
@@ -170,7 +429,23 @@ public:
         return operator()(buffer.samples(), buffer.count(), config);
     }
 
-    WhisperReturnValue operator()(const float* samples, size_t count, const WhisperJobConfig& config = WhisperJobConfig(), std::function<bool(WhisperSegments&&)> callback = nullptr) {
+    // with preempt, the transcription may stop at a VAD window boundary (returns -7) saving its progress to be resumed from;
+    // with wait, the samples are still arriving and VAD ranges are transcribed as soon as they are detected
+    WhisperReturnValue operator()(const float* samples, size_t count, const WhisperJobConfig& config = WhisperJobConfig(), std::function<bool(WhisperSegments&&)> callback = nullptr,
+            WhisperProgress* progress = nullptr, std::function<bool()> preempt = nullptr, SampleWait wait = nullptr) {
+        return transcribe(samples, count, config, callback, progress, preempt, wait);
+    }
+
+    // 16-bit samples (queued jobs) are converted to float one speech window at a time
+    WhisperReturnValue operator()(const int16_t* samples, size_t count, const WhisperJobConfig& config = WhisperJobConfig(), std::function<bool(WhisperSegments&&)> callback = nullptr,
+            WhisperProgress* progress = nullptr, std::function<bool()> preempt = nullptr) {
+        return transcribe(samples, count, config, callback, progress, preempt, nullptr);
+    }
+
+private:
+    template <typename Sample>
+    WhisperReturnValue transcribe(const Sample* samples, size_t count, const WhisperJobConfig& config, std::function<bool(WhisperSegments&&)> callback,
+            WhisperProgress* progress, std::function<bool()> preempt, SampleWait wait) {
 
         // if (use_vad && !vad_model)
         //     use_vad = false;  // TODO: should we fail here, or continue silently? or issue a warning?
@@ -178,6 +453,8 @@ public:
         log.debug("whisper config.lang: {}", config.lang);
 
         int64_t offset_ms = 0;  // this will be filled (for new segments callback to adjust timestamps) when VAD is used; does it relate to params/config.offset_ms ?
+        const SpeechWindow* window = nullptr;  // current (possibly packed) VAD window, maps timestamps back to the source audio
+        bool defer_segments = false;  // new segments are held back while a reduced audio context run may still be rejected
 
         bool use_vad = config.use_vad && vad_model;
 
@@ -185,17 +462,20 @@ public:
 
         std::string lang = config.lang;
 
+        // a resumed transcription continues with the language detected before
+        if (progress && !progress->lang.empty() && (lang == "" || lang == "auto"))
+            lang = progress->lang;
+
         log.debug("whisper lang: {}", lang);
 
         struct whisper_context * ctx = model.ctx;
         struct whisper_state *state = this->state.get();
 
+        // a state checked out from the pool may carry the text context of its previous user
+        bool reset_state = !this->state;
+
         // if (config.reset)
         //     free();
-        if (!this->state) {
-            this->state = std::shared_ptr<struct whisper_state>(whisper_init_state(ctx), whisper_state_deleter());
-            state = this->state.get();
-        }
         // if (!state)
         //     state = whisper_init_state(ctx);
 
@@ -212,7 +492,7 @@ public:
         params.duration_ms = config.duration_ms;  // audio duration to process in ms
 
         params.translate = config.translate;
-        params.no_context = config.reset; // do not use past transcription (if any) as initial prompt for the decoder
+        params.no_context = config.reset || reset_state; // do not use past transcription (if any) as initial prompt for the decoder
         // bool no_timestamps;            // do not generate timestamps
         // bool single_segment;           // force single segment output (useful for streaming)
 
@@ -305,9 +585,11 @@ public:
         if (callback) {
             params.new_segment_callback = newSegmentCallbacks.callback;
             params.new_segment_callback_user_data = newSegmentCallbacks([&](struct whisper_context * ctx, struct whisper_state * state, int n_new) {
+                if (defer_segments)
+                    return;
                 WhisperSegments segments;
                 log.trace("got {} new segments", n_new);
-                getSegments(segments, -n_new, -1, offset_ms);
+                getSegments(segments, -n_new, -1, offset_ms, window);
                 // std::cout << "GOT OFFSET " << offset_ms << std::endl;
                 // if (offset_ms > 0)
                 //     offsetSegments(segments, offset_ms);
@@ -347,53 +629,117 @@ public:
         token_timestamps = params.token_timestamps;
         dtw_enabled = model.dtw_enabled;
 
-        do_abort = false;
+        // the flag is not cleared here, an abort() that comes before the transcription starts is not lost
+        if (do_abort)
+            return -6;
 
         int r = 0;
 
         segments.clear();
 
-        if (use_vad) {
+        // runs whisper on a single input (window), with encoder context reduced to the input duration if configured;
+        // the state is checked out from the pool only here, so that a growing input or silence does not hold one
+        const auto run = [&](const float* data, size_t n) -> int {
+            if (!this->state) {
+                this->state = model.states ? model.states->acquire(config.state_wait_ms) : nullptr;
+                if (!this->state)
+                    return -101;  // no free whisper state
+                state = this->state.get();
+            }
 
-            VAD vad(vad_model, config.vad_config);
+            int audio_ctx = adaptiveAudioCtx(n, config);
 
-            size_t prev_end = 0;
+            if (audio_ctx <= 0) {
+                params.audio_ctx = config.audio_ctx;
+                return whisper_full_with_state(ctx, state, params, data, n);
+            }
 
-            double ms = 1000.0 / (double)vad.sample_rate();
+            params.audio_ctx = audio_ctx;
+            defer_segments = params.new_segment_callback != nullptr;
 
-            log.trace("running VAD");
+            int r = whisper_full_with_state(ctx, state, params, data, n);
 
-            vad.start(samples, count);
+            defer_segments = false;
 
-            for (auto& sr : vad) {
-                // sr.start, sr.end, vad.sample_rate()
+            if (r != 0)
+                return r;
 
-                log.debug("VAD range detected ({},{}): from {} ms till {} ms, duration {} ms of speech after {} ms of non-speech",
-                        sr.start, sr.end, sr.start * ms, sr.end * ms, (sr.end - sr.start) * ms, (sr.start - prev_end) * ms);
-                // continue;
-                // std::cout << "VAD range detected: " << sr.start * vad.sample_rate() * 1000 << " ms -> " << sr.end * vad.sample_rate() * 1000
-                //     << " ms  (duration: " << (sr.end - sr.start) * vad.sample_rate() * 1000 << " ms)" << std::endl;
+            if (hasTimestampAnomalies(n)) {
+                log.debug("audio_ctx {} gave anomalous result for {} ms of audio, re-running with full context", audio_ctx, n * 1000 / WHISPER_SAMPLE_RATE);
+                bool no_context = params.no_context;
+                params.audio_ctx = config.audio_ctx;
+                params.no_context = true;   // do not prompt the decoder with the rejected transcription
+                r = whisper_full_with_state(ctx, state, params, data, n);
+                params.no_context = no_context;
+                return r;
+            }
+
+            // pass the held back segments all at once
+            if (params.new_segment_callback)
+                params.new_segment_callback(ctx, state, whisper_full_n_segments_from_state(state), params.new_segment_callback_user_data);
 
-                size_t no_speech_size = sr.start - prev_end;
+            return r;
+        };
+
+        if (use_vad) {
+
+            VAD vad(vad_model, config.vad_config);
+
+            size_t base = progress ? std::min(progress->resume_sample, count) : 0;   // resume point of a preempted transcription
+            size_t prev_end = base;
+            size_t prev_range_end = base;
+            int windows = 0;
+
+            if (progress && !progress->prompt.empty()) {
+                // replace whatever context the state has with the one saved at preemption
+                params.no_context = true;
+                params.prompt_tokens = progress->prompt.data();
+                params.prompt_n_tokens = progress->prompt.size();
+            }
+
+            double ms = 1000.0 / (double)vad.sample_rate();
+
+            SpeechWindowPacker packer(vad.sample_rate(), config.pack_window_ms, config.pack_gap_ms, config.reset_min_nospeech_ms);
+            std::vector<float> packed;
+
+            const auto process = [&](const SpeechWindow& w) -> bool {
+                size_t no_speech_size = w.start() - prev_end;
 
                 // if (prev_end > 0 && no_speech_size >= 10 * vad.sample_rate() [# reset context after 10s of no speech #])
                 if (prev_end > 0 && no_speech_size * ms >= config.reset_min_nospeech_ms /* reset context after 10s of no speech */)
                     params.no_context = true;
 
                 // offset_ms = sr.start * 100 [# s to ms #] / vad.sample_rate();
-                offset_ms = sr.start * ms;
+                offset_ms = w.start() * ms;
+                window = &w;
+
+                if (w.ranges > 1)
+                    log.debug("{} speech ranges packed into window of {} ms", w.ranges, w.size() * ms);
 
                 if (do_abort) {
                     r = -6;
-                    break;
+                    return false;
                 }
 
-                r = whisper_full_with_state(ctx, state, params, &samples[sr.start], sr.end - sr.start);
+                if (progress && preempt && windows > 0 && preempt()) {
+                    saveProgress(*progress, prev_end);
+                    log.debug("preempted at {} ms", prev_end * ms);
+                    r = -7;
+                    return false;
+                }
+
+                r = run(w.data(samples, packed), w.size());
 
                 if (r != 0)
-                    break;
+                    return false;
 
-                prev_end = sr.end;
+                prev_end = w.end();
+                windows++;
+
+                if (params.prompt_tokens) {
+                    params.prompt_tokens = nullptr;
+                    params.prompt_n_tokens = 0;
+                }
 
                 if (params.no_context)
                     params.no_context = false;
@@ -406,26 +752,109 @@ public:
                 //     params.detect_language = false;
                 // }
 
-                getSegments(segments, 0, -1, offset_ms);
+                getSegments(segments, 0, -1, offset_ms, &w);
+                window = nullptr;
 
-                // std::cout << "GOT OFFSET " << offset_ms << std::endl;
-                // if (offset_ms > 0)
-                //     offsetSegments(segments, offset_ms);
+                return true;
+            };
+
+            // VAD runs ahead on its own thread, so that detection overlaps with the encoder and decoder
+            BlockingQueue<speech_range> vad_ranges(std::max(1, config.vad_queue_ranges));
+            std::exception_ptr vad_error;   // read after the producer is joined
+            std::thread vad_producer([&] {
+                try {
+                    // ranges of the same audio and VAD configuration from an earlier run, clipped to the resume point;
+                    // the key of a growing input is known only once all of it has arrived
+                    std::string key = vad_cache && !wait ? vad.cache_key(samples, count) : "";
+                    if (auto cached = vad_cache ? vad_cache->get(key) : std::nullopt; cached) {
+                        log.trace("reusing {} cached VAD ranges", cached->size());
+                        for (auto& vad_range : cached.value()) {
+                            if (vad_range.end <= (int)base)
+                                continue;
+                            if (!vad_ranges.push(speech_range(std::max(vad_range.start, (int)base), vad_range.end)))
+                                break;
+                        }
+                        vad_ranges.close();
+                        return;
+                    }
+
+                    log.trace("running VAD");
+                    std::vector<speech_range> detected;
+                    bool complete = true;
+                    if (wait)
+                        vad.start(samples + base, count - base, [&](size_t n) { return std::max(wait(n + base), base) - base; });
+                    else
+                        vad.start(samples + base, count - base);
+                    for (auto& vad_range : vad) {
+                        detected.emplace_back(vad_range.start + (int)base, vad_range.end + (int)base);
+                        if (!vad_ranges.push(detected.back())) {
+                            complete = false;
+                            break;
+                        }
+                    }
+                    // only ranges of the whole audio are reusable
+                    if (vad_cache && complete && base == 0 && !vad.stopped() && (!wait || wait(count) >= count))
+                        vad_cache->put(wait ? vad.cache_key(samples, count) : key, detected);
+                } catch (const std::exception& e) {
+                    log.error("VAD failed: {}", e.what());
+                    vad_error = std::current_exception();
+                } catch (...) {
+                    vad_error = std::current_exception();
+                }
+                vad_ranges.close();
+            });
+
+            while (auto vad_range = vad_ranges.pop()) {
+                speech_range sr = vad_range.value();
+                // sr.start, sr.end, vad.sample_rate()
+
+                log.debug("VAD range detected ({},{}): from {} ms till {} ms, duration {} ms of speech after {} ms of non-speech",
+                        sr.start, sr.end, sr.start * ms, sr.end * ms, (sr.end - sr.start) * ms, (sr.start - prev_range_end) * ms);
+                // continue;
+                // std::cout << "VAD range detected: " << sr.start * vad.sample_rate() * 1000 << " ms -> " << sr.end * vad.sample_rate() * 1000
+                //     << " ms  (duration: " << (sr.end - sr.start) * vad.sample_rate() * 1000 << " ms)" << std::endl;
+
+                prev_range_end = sr.end;
 
-                log.trace("running VAD");
+                if (!config.pack_ranges) {
+                    if (!process(SpeechWindow(sr, vad.sample_rate())))
+                        break;
+                } else if (auto w = packer.add(sr); w && !process(w.value())) {
+                    break;
+                }
+            }
+
+            // stop the producer if transcription ended early
+            vad.stop();
+            vad_ranges.close();
+            vad_producer.join();
+
+            // ranges after the failure are missing, the transcription is incomplete
+            if (vad_error && r == 0)
+                r = -102;
+
+            if (r == 0 && config.pack_ranges) {
+                if (auto w = packer.flush(); w)
+                    process(w.value());
             }
 
             // TODO: if state is reused, segments ar cleared on whisper_full call?
 
         } else {
             log.trace("whisper input samples = {}", (size_t)samples);
-            r = whisper_full_with_state(ctx, state, params, samples, count);
+            if (wait)
+                count = std::min(count, wait(count));
+            std::vector<float> converted;   // the whole input of 16-bit samples
+            SpeechWindow whole(speech_range(0, (int)count), WHISPER_SAMPLE_RATE);
+            r = run(whole.data(samples, converted), count);
         }
 
         log.debug("done");
 
         if (r != 0) {
             log.trace("whisper exited with code: {}", r);
+            if (r != -6 && r != -7 && r != -102 && this->state)
+                model.states->discard(this->state.get());  // do not reuse state after an error (abort, preemption and VAD failure are not its errors)
             free();  // reset on error
             // cerr << "whisper error" << endl;
             if (params.abort_callback_user_data)
@@ -447,15 +876,77 @@ public:
         return r;
     }
 
+public:
     void abort() { log.trace("setting abort flag"); do_abort = true; }
+    // before reuse for the next job
+    void resetAbort() { do_abort = false; }
+
+    // text context and language of the last window, so that a preempted transcription can be resumed with another state
+    void saveProgress(WhisperProgress& progress, size_t resume_sample) {
+        struct whisper_state *state = this->state.get();
+        progress.resume_sample = resume_sample;
+        if (int lang_id = whisper_full_lang_id_from_state(state); lang_id >= 0)
+            progress.lang = whisper_lang_str(lang_id);
+        whisper_token eot = whisper_token_eot(model.ctx);
+        std::vector<whisper_token> tokens;
+        int n_segments = whisper_full_n_segments_from_state(state);
+        for (int i = 0; i < n_segments; i++) {
+            int n_tokens = whisper_full_n_tokens_from_state(state, i);
+            for (int j = 0; j < n_tokens; j++) {
+                whisper_token id = whisper_full_get_token_id_from_state(state, i, j);
+                if (id < eot)   // text tokens only
+                    tokens.push_back(id);
+            }
+        }
+        size_t max_tokens = whisper_n_text_ctx(model.ctx) / 2;  // whisper uses at most this many prompt tokens
+        if (tokens.size() > max_tokens)
+            tokens.erase(tokens.begin(), tokens.end() - max_tokens);
+        progress.prompt = std::move(tokens);
+    }
+
+    // encoder context (in 20 ms frames) covering n samples plus margin, 0 - use full context
+    int adaptiveAudioCtx(size_t n, const WhisperJobConfig& config) const {
+        if (!config.adaptive_audio_ctx)
+            return 0;
+        int n_audio_ctx = whisper_model_n_audio_ctx(model.ctx);
+        int64_t ms = (int64_t)n * 1000 / WHISPER_SAMPLE_RATE + config.audio_ctx_margin_ms;
+        int audio_ctx = std::max((int)((ms + 19) / 20), config.audio_ctx_min);
+        return audio_ctx < n_audio_ctx ? audio_ctx : 0;
+    }
+
+    // signs that a reduced audio context confused the decoder: immediate EOT or timestamps outside the input
+    bool hasTimestampAnomalies(size_t n) {
+        struct whisper_state *state = this->state.get();
+        int n_segments = whisper_full_n_segments_from_state(state);
+        if (n_segments == 0)
+            return false;   // VAD may pass windows without words, an empty result is not rerun with full context
+        int64_t end = (int64_t)n * 100 / WHISPER_SAMPLE_RATE + 50;  // input duration in 10 ms units plus 0.5 s tolerance
+        int64_t prev_t0 = 0;
+        bool has_text = false;
+        for (int i = 0; i < n_segments; i++) {
+            int64_t t0 = whisper_full_get_segment_t0_from_state(state, i);
+            int64_t t1 = whisper_full_get_segment_t1_from_state(state, i);
+            if (t1 < t0 || t0 < prev_t0 || t1 > end)
+                return true;
+            prev_t0 = t0;
+            const char* text = whisper_full_get_segment_text_from_state(state, i);
+            for (; text && *text && !has_text; text++)
+                has_text = !std::isspace((unsigned char)*text);
+        }
+        return !has_text;
+    }
 
     size_t numberOfSegments() {
         struct whisper_state *state = this->state.get();
+        if (!state)
+            return 0;   // nothing was transcribed
         return whisper_full_n_segments_from_state(state);
     }
 
     std::string detectedLanguage() {
         struct whisper_state *state = this->state.get();
+        if (!state)
+            return "";
         return whisper_lang_str(whisper_full_lang_id_from_state(state));
     }
 
@@ -499,8 +990,10 @@ public:
         }
     }
 
-    void getSegments(WhisperSegments& segments, int first = 0, int last = -1, int64_t offset_ms = 0) {
+    void getSegments(WhisperSegments& segments, int first = 0, int last = -1, int64_t offset_ms = 0, const SpeechWindow* window = nullptr) {
         struct whisper_state *state = this->state.get();
+        if (!state)
+            return;
         int n_segments = whisper_full_n_segments_from_state(state);
         if (last < 0 || last > n_segments)
             last = n_segments;
@@ -511,7 +1004,9 @@ public:
         for (int i = first; i < last; i++) {
             segments.emplace_back();
             getSegment(segments.back(), i);
-            if (offset_ms > 0)
+            if (window != nullptr)
+                mapSegment(segments.back(), *window);
+            else if (offset_ms > 0)
                 offsetSegment(segments.back(), offset_ms);
             // getSegment(segments[i], i);
         }
@@ -527,7 +1022,7 @@ public:
     WhisperResult getResult(int first_segment = 0, int last_segment = -1) {
         struct whisper_state *state = this->state.get();
         WhisperResult result;
-        result.lang = whisper_lang_str(whisper_full_lang_id_from_state(state));
+        result.lang = state ? whisper_lang_str(whisper_full_lang_id_from_state(state)) : "";
         if (segments.empty())
             getSegments(result.segments, first_segment, last_segment);
         else
@@ -553,6 +1048,21 @@ public:
             offsetSegment(segment, offset_ms);
     }
 
+    void mapSegment(WhisperSegment& segment, const SpeechWindow& window) {
+        segment.t0 = window.map(segment.t0);
+        segment.t1 = window.map(segment.t1);
+        for (auto& token : segment.tokens) {
+            token.t0 = window.map(token.t0);
+            token.t1 = window.map(token.t1);
+            token.t_dtw = window.map(token.t_dtw);
+        }
+    }
+
+    void mapSegments(WhisperSegments& segments, const SpeechWindow& window) {
+        for (auto& segment : segments)
+            mapSegment(segment, window);
+    }
+
     /* deprecated */
     json segments_to_json() {
         struct whisper_context *ctx = model.ctx;
@@ -775,7 +1285,7 @@ public:
 private:
     bool token_timestamps = false;
     bool dtw_enabled = false;
-    bool do_abort = false;
+    std::atomic_bool do_abort = false;  // set from other threads by abort()
 };
 
 
@@ -796,6 +1306,11 @@ bool WhisperModel::init(const std::string& model, const std::string& dtw, bool u
     return impl->init(model, dtw, use_gpu, gpu_device);
 }
 
+void WhisperModel::configureStatePool(int max_states, int prewarm) {
+    if (impl)
+        impl->configureStatePool(max_states, prewarm);
+}
+
 
 
 
@@ -819,6 +1334,11 @@ void Whisper::setVADModel(VADModel& model) {
         impl->setVADModel(model);
 }
 
+void Whisper::setVADCache(std::shared_ptr<VADRangeCache> cache) {
+    if (impl)
+        impl->setVADCache(cache);
+}
+
 WhisperReturnValue Whisper::operator()(const void* wav_data, size_t wav_size, const WhisperJobConfig& config) {
     return impl->operator()(wav_data, wav_size, config);
 }
@@ -826,6 +1346,10 @@ WhisperReturnValue Whisper::operator()(const void* wav_data, size_t wav_size, co
 WhisperReturnValue Whisper::operator()(const float* samples, size_t count, const WhisperJobConfig& config) {
     return impl->operator()(samples, count, config);
 }
+
+WhisperReturnValue Whisper::operator()(const float* samples, size_t count, const WhisperJobConfig& config, SampleWait wait) {
+    return impl->operator()(samples, count, config, nullptr, nullptr, nullptr, wait);
+}
 // bool Whisper::operator()(const void* wav_data, size_t wav_size, const std::string& lang, bool reset, bool use_vad, VADConfig vad_config) {
 //     return impl->operator()(wav_data, wav_size, lang, reset, use_vad, vad_config);
 // }
@@ -869,6 +1393,22 @@ json Whisper::segments_to_json() {
 
 
 
+// per job notification, waiters are woken on every status transition and segment append
+struct WhisperJobEvents {
+    std::shared_mutex mutex;
+    std::condition_variable_any cv;
+
+    // every change of the guarded state goes through here, so that no waiter misses it
+    template <class F>
+    void update(F&& change) {
+        {
+            std::unique_lock<std::shared_mutex> lock(mutex);
+            change();
+        }
+        cv.notify_all();
+    }
+};
+
 struct WhisperJobInternal : public WhisperJob {
     // SharedBuffer<float> samples;
     // SharedBuffer<void> wav;
@@ -877,10 +1417,7 @@ struct WhisperJobInternal : public WhisperJob {
 
     WhisperJobStatus status = WhisperJobStatus::Waiting;
 
-    ReferenceKeeper<std::shared_mutex> mutex = nullptr;
-    ReferenceKeeper<std::condition_variable_any> cv = nullptr;
-    // std::shared_mutex *mutex = nullptr;
-    // std::condition_variable_any *cv = nullptr;
+    WhisperJobEvents events;    // guards segments and split state, wakes waiters
 
     WhisperSegments segments;
 
@@ -888,96 +1425,298 @@ struct WhisperJobInternal : public WhisperJob {
     WhisperJobInternal(WhisperJob&& job) : WhisperJob(std::move(job)) {}
         // *(whisper_token_data*)(&token) = whisper_full_get_token_data_from_state(state, i_segment, i_token);
 
-    bool do_abort = false;
+    std::atomic_bool do_abort = false;
+
+    // speech ranges of a split job are transcribed in parallel and reassembled in order (guarded by events.mutex)
+    struct {
+        std::vector<WhisperSegments> results;
+        std::vector<bool> done;
+        size_t emitted = 0;     // ranges already appended to segments
+        int pending = 0;        // ranges dispatched but not yet finished
+        bool failed = false;
+        bool aborted = false;
+    } split;
+
+    // scheduling
+    int64_t queued_ms = 0;     // first enqueued, kept across preemptions so that the job keeps its aging credit
+    double duration_s = 0;  // audio duration (remaining, if preempted)
+    WhisperProgress progress;   // where a preempted job resumes
+
+    // counted in the admission totals while waiting
+    bool queued = false;
+    double queued_audio_s = 0;
+    size_t queued_bytes = 0;
+
+    // retention bookkeeping, results are immutable once the job is finished
+    std::atomic_bool finished = false;
+    int64_t finished_ms = 0;
+    std::atomic<int64_t> last_access_ms = 0;
+    size_t result_bytes = 0;
+    bool spilled = false;   // already in the spill storage, no need to store again on eviction
+
+    // audio written to a file while waiting, mapped back when the job starts (guarded by audio_mutex)
+    std::mutex audio_mutex;
+    std::string audio_file;
+    size_t audio_count = 0;
+    bool audio_mapped = false;
+
+    ~WhisperJobInternal() {
+        std::lock_guard<std::mutex> lock(audio_mutex);
+        removeAudioFile();
+    }
+
+    // the caller holds audio_mutex
+    void removeAudioFile() {
+        if (!audio_file.empty())
+            std::remove(audio_file.c_str());
+        audio_file.clear();
+    }
+
+    void free() {
+        std::lock_guard<std::mutex> lock(audio_mutex);
+        samples.free();
+        samples_s16.free();
+        wav.free();
+        removeAudioFile();
+    }
+};
+
+struct WhisperRangeTask {
+    std::shared_ptr<WhisperJobInternal> job;
+    size_t index = 0;
+    SpeechWindow window;
+};
 
-    void free() { samples.free(); wav.free(); }
-    // TODO: write to disk
+// either a new job or a speech range of an already running split job
+struct WhisperWorkItem {
+    std::shared_ptr<WhisperJobInternal> job;
+    std::optional<WhisperRangeTask> range;
 };
 
 
 struct WhisperProcessingThreadData {
     std::thread thread;
-    std::shared_mutex job_mutex;
-    std::condition_variable_any cv;
-    bool do_abort = false;
+    std::mutex mutex;   // guards job
+    const WhisperJobInternal* job = nullptr;    // job (or range of the job) being processed, kept alive by the processor
+    std::atomic_bool do_abort = false;
     WhisperImpl* whisper = nullptr;
-    WhisperJobID* job_id = nullptr;
+};
+
+// orders queued jobs: explicit priority first, then clients with fewer running jobs (fair share), then the policy
+class WhisperJobScheduler {
+public:
+    void configure(WhisperSchedulingPolicy policy, bool fair_share, double aging) {
+        std::lock_guard<std::mutex> lock(mutex);
+        this->policy = policy;
+        this->fair_share = fair_share;
+        this->aging = aging;
+    }
+
+    // index of the next job among items[first..], called with the work queue locked
+    size_t select(const std::deque<WhisperWorkItem>& items, size_t first) {
+        std::lock_guard<std::mutex> lock(mutex);
+        int64_t now = now_ms();
+        size_t best = first;
+        for (size_t i = first + 1; i < items.size(); i++) {
+            if (items[i].job && items[best].job && before(*items[i].job, *items[best].job, now, running_clients))
+                best = i;
+        }
+        return best;
+    }
+
+    // queued jobs in the order they are expected to start
+    std::vector<const WhisperJobInternal*> order(std::vector<const WhisperJobInternal*> jobs) {
+        std::lock_guard<std::mutex> lock(mutex);
+        int64_t now = now_ms();
+        auto clients = running_clients;
+        std::vector<const WhisperJobInternal*> result;
+        while (!jobs.empty()) {
+            size_t best = 0;
+            for (size_t i = 1; i < jobs.size(); i++) {
+                if (before(*jobs[i], *jobs[best], now, clients))
+                    best = i;
+            }
+            result.push_back(jobs[best]);
+            clients[jobs[best]->client]++;
+            jobs.erase(jobs.begin() + best);
+        }
+        return result;
+    }
+
+    // estimated time until all the given jobs and the remaining part of running ones are processed
+    double estimate(const std::vector<const WhisperJobInternal*>& jobs, int instances) {
+        std::lock_guard<std::mutex> lock(mutex);
+        int64_t now = now_ms();
+        double work = 0;
+        for (auto& [job, started_ms] : running)
+            work += std::max(0.0, job->duration_s * rtf - (now - started_ms) / 1000.0);
+        for (auto job : jobs)
+            work += job->duration_s * rtf;
+        return work / std::max(1, instances);
+    }
+
+    void started(const WhisperJobInternal& job) {
+        std::lock_guard<std::mutex> lock(mutex);
+        running[&job] = now_ms();
+        running_clients[job.client]++;
+    }
+
+    void configurePreemption(bool enable, double short_job_s, double min_run_s) {
+        std::lock_guard<std::mutex> lock(mutex);
+        preemption = enable;
+        preempt_short_job_s = short_job_s;
+        preempt_min_run_s = min_run_s;
+    }
+
+    // a waiting job should interrupt the running one: it has higher priority, or it is short (shortest first) while
+    // the running one is long and has already run for a while
+    bool shouldPreempt(const WhisperJobInternal& job, const std::vector<const WhisperJobInternal*>& queued) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!preemption)
+            return false;
+        auto it = running.find(&job);
+        if (it == running.end() || (now_ms() - it->second) / 1000.0 < preempt_min_run_s)
+            return false;
+        for (auto waiting : queued) {
+            if (waiting->priority > job.priority)
+                return true;
+            if (policy == WhisperSchedulingPolicy::ShortestFirst && waiting->priority == job.priority &&
+                    waiting->duration_s <= preempt_short_job_s && job.duration_s > 10 * waiting->duration_s)
+                return true;
+        }
+        return false;
+    }
+
+    void finished(const WhisperJobInternal& job, bool measure) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = running.find(&job);
+        if (it == running.end())
+            return;
+        if (measure && job.duration_s > 1.0) {
+            // exponential moving average of the real time factor
+            double elapsed_s = (now_ms() - it->second) / 1000.0;
+            rtf = 0.8 * rtf + 0.2 * (elapsed_s / job.duration_s);
+        }
+        running.erase(it);
+        if (--running_clients[job.client] <= 0)
+            running_clients.erase(job.client);
+    }
+
+    double realTimeFactor() { std::lock_guard<std::mutex> lock(mutex); return rtf; }
+
+    static int64_t now_ms() {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+private:
+    bool before(const WhisperJobInternal& a, const WhisperJobInternal& b, int64_t now, const std::unordered_map<std::string, int>& clients) const {
+        if (a.priority != b.priority)
+            return a.priority > b.priority;
+        if (fair_share) {
+            auto count = [&](const std::string& client) { auto it = clients.find(client); return it == clients.end() ? 0 : it->second; };
+            int ca = count(a.client), cb = count(b.client);
+            if (ca != cb)
+                return ca < cb;
+        }
+        if (policy == WhisperSchedulingPolicy::ShortestFirst) {
+            double sa = a.duration_s - aging * (now - a.queued_ms) / 1000.0;
+            double sb = b.duration_s - aging * (now - b.queued_ms) / 1000.0;
+            if (sa != sb)
+                return sa < sb;
+        }
+        return a.queued_ms < b.queued_ms;
+    }
+
+    std::mutex mutex;
+    WhisperSchedulingPolicy policy = WhisperSchedulingPolicy::FIFO;
+    bool fair_share = false;
+    double aging = 10.0;
+    double rtf = 0.25;  // processing time per second of audio, until measured
+    bool preemption = false;
+    double preempt_short_job_s = 60;
+    double preempt_min_run_s = 10;
+    std::unordered_map<const WhisperJobInternal*, int64_t> running;     // running jobs and their start time
+    std::unordered_map<std::string, int> running_clients;
 };
 
 class WhisperQueueProcessorImpl {
     inline static logger log = new_logger("whisper-queue");
     WhisperModelImpl& model;
     VADModel vad_model;
+    std::shared_ptr<VADRangeCache> vad_cache;
 public:
-    WhisperQueueProcessorImpl(WhisperModelImpl& model, int max_instances = 2) : model(model), max_instances(max_instances) {}
-    WhisperQueueProcessorImpl(WhisperModelImpl& model, VADModel& vad_model, int max_instances = 2) : model(model), vad_model(vad_model), max_instances(max_instances) {}
+    WhisperQueueProcessorImpl(WhisperModelImpl& model, int max_instances = 2) : model(model), max_instances(max_instances) { start(); }
+    WhisperQueueProcessorImpl(WhisperModelImpl& model, VADModel& vad_model, int max_instances = 2) : model(model), vad_model(vad_model), max_instances(max_instances) { start(); }
+    ~WhisperQueueProcessorImpl() { stop(); }
 
     void setVADModel(VADModel& model) { vad_model = model; }
+    void setVADCache(std::shared_ptr<VADRangeCache> cache) { vad_cache = cache; }
+
+    // split VAD speech ranges of a single job across all processor instances
+    void setSplitRanges(bool enable) { split_ranges = enable; }
 
     typedef int job_id;
     typedef int instance_id;
 
-    // std::map<std::thread::id, WhisperProcessingThreadData> threads;
-    void cleanup() {
-        for (auto it = threads.begin(); it != threads.end(); ) {
-            auto& data = it->second;
-            // TODO: protect with global mutex
-            if (!data.thread.joinable() /*&& !data.job_mutex && !data.cv*/ /* TODO: check if still in use */) {
-                it = threads.erase(it); // erase returns the next iterator
-            } else {
-                ++it; // move to the next element
-            }
-        }
+    // queued audio is kept as 16-bit samples, half the memory of float
+    static void compact(WhisperJob& job) {
+        if (job.samples.empty() || !job.samples_s16.empty())
+            return;
+        size_t count = job.samples.count;
+        int16_t* samples = new int16_t[count];
+        f32_to_s16(job.samples.data, samples, count);
+        job.samples_s16 = SharedBuffer<int16_t>(samples, [](int16_t* samples) { delete[] samples; }, count);
+        job.samples.free();
     }
 
+    static size_t sample_count(const WhisperJob& job) { return job.samples.empty() ? job.samples_s16.count : job.samples.count; }
+
     WhisperJobID add(WhisperJob&& job) {
         WhisperJobID id;
+        std::shared_ptr<WhisperJobInternal> job_ptr;
+        compact(job);
         {
             std::unique_lock<std::shared_mutex> lock(jobs_mutex);
             id = newJobID();
             while (jobs.count(id) > 0)
                 id = newJobID();
 
-            auto r = jobs.emplace(std::make_pair(id, std::move(job)));
-            {
-                WhisperJobInternal& job = r.first->second;
-                job.id = id;
-                job.status = WhisperJobStatus::Waiting;
-            }
+            auto r = jobs.emplace(std::make_pair(id, std::make_shared<WhisperJobInternal>(std::move(job))));
+            job_ptr = r.first->second;
+            job_ptr->id = id;
+            job_ptr->status = WhisperJobStatus::Waiting;
+            job_ptr->last_access_ms = now_ms();
+            job_ptr->queued_ms = job_ptr->last_access_ms;
+            job_ptr->duration_s = (double)job_ptr->samples_s16.count / WHISPER_SAMPLE_RATE;
         }
-        {
-            std::lock_guard<std::mutex> lock(job_queue_mutex);
-            job_queue.push(id);
-        }
-        // if (threads.size() < max_instances)
-        cleanup();
-        if (active_threads.load() < max_instances)
-            start_thread();
+
+        if (overResidentBudget(job_ptr->samples_s16.count * sizeof(int16_t)))
+            spillAudio(*job_ptr);
+
+        enqueued(*job_ptr);
+
+        work_queue.push(WhisperWorkItem{ job_ptr });
+
+        evict();
 
         return id;
     }
 
     std::optional<WhisperJobStatus> wait(WhisperJobID id, const std::function<bool(const WhisperSegments&, size_t)>& callback) {
-        if (auto opt = getJob(id); opt) {
-            auto& job = opt.value();
-            // auto& mutex = *job.mutex;
-            // auto& cv = *job.cv;
-            auto mutex_keeper = job.mutex.scoped();
-            auto cv_keeper = job.cv.scoped();
-            auto& mutex = job.mutex.ref();
-            auto& cv = job.cv.ref();
+        if (auto job_ptr = getJob(id); job_ptr) {
+            auto& job = *job_ptr;
+            auto& events = job.events;
 
             size_t consumed = 0;
 
+            const auto active = [&] { return job.status == WhisperJobStatus::Waiting || job.status == WhisperJobStatus::Running; };
+
             while (true) {
 
-                std::shared_lock<std::shared_mutex> lock(mutex);
+                std::shared_lock<std::shared_mutex> lock(events.mutex);
 
-                // TODO: add abort option, i.e., done
-                // optionally can be used with lambda: cv.wait(lock, [] { return ready; });
-                while (consumed >= job.segments.size() && job.status == WhisperJobStatus::Running && !job.do_abort) {
-                    cv.wait(lock);
-                }
+                // blocks through waiting as well, woken on new segments or status change
+                events.cv.wait(lock, [&] { return consumed < job.segments.size() || !active(); });
 
                 // if (job.do_abort)
                 //     return false;
@@ -989,7 +1728,7 @@ public:
 
                 consumed = job.segments.size();
 
-                if (job.status != WhisperJobStatus::Running)
+                if (!active())
                     break;
             }
 
@@ -1001,97 +1740,664 @@ public:
 
             // TODO: finished, now there is no more need for locking, as all the job content must be read only at this point
 
+            std::shared_lock<std::shared_mutex> lock(events.mutex);
             return job.status;
         }
         return std::nullopt;
     }
 
+    void setAdmissionLimits(size_t max_jobs, double max_audio_s, size_t max_bytes) {
+        std::lock_guard<std::mutex> lock(admission_mutex);
+        max_queued_jobs = max_jobs;
+        max_queued_audio_s = max_audio_s;
+        max_queued_bytes = max_bytes;
+    }
+
+    // would a job of the given audio duration and sample memory fit into the limits on waiting jobs
+    WhisperAdmission checkAdmission(double audio_s, size_t bytes) {
+        WhisperAdmission admission;
+        double excess = 0;  // part of the waiting jobs that has to be processed first
+
+        {
+            std::lock_guard<std::mutex> lock(admission_mutex);
+
+            const auto check = [&](const char* reason, double limit, double queued, double size) {
+                if (limit <= 0 || queued + size <= limit)
+                    return;
+                admission.accepted = false;
+                admission.reason = reason;
+                if (size > limit)
+                    admission.permanent = true;
+                else if (queued > 0)
+                    excess = std::max(excess, (queued + size - limit) / queued);
+            };
+
+            check("jobs", (double)max_queued_jobs, (double)queued_totals.jobs, 1);
+            check("audio", max_queued_audio_s, queued_totals.audio_s, audio_s);
+            check("bytes", (double)max_queued_bytes, (double)queued_totals.bytes, (double)bytes);
+        }
+
+        if (!admission.accepted && !admission.permanent) {
+            // waiting jobs are drained at the measured real time factor
+            std::vector<std::shared_ptr<WhisperJobInternal>> queued;
+            work_queue.for_each([&](const WhisperWorkItem& item) {
+                if (!item.range)
+                    queued.push_back(item.job);
+            });
+            std::vector<const WhisperJobInternal*> waiting;
+            for (auto& queued_job : queued)
+                waiting.push_back(queued_job.get());
+            double drain_s = scheduler.estimate(waiting, max_instances);
+            admission.retry_after_s = std::clamp(drain_s * std::min(1.0, excess), 1.0, 3600.0);
+        }
+
+        return admission;
+    }
+
+    // the same estimate as tryAdd() for audio of the given duration that is not received yet
+    WhisperAdmission checkAdmission(double audio_s) {
+        return checkAdmission(audio_s, admissionBytes((size_t)(audio_s * WHISPER_SAMPLE_RATE)));
+    }
+
+    std::optional<WhisperJobID> tryAdd(WhisperJob&& job, WhisperAdmission& admission) {
+        std::lock_guard<std::mutex> lock(admit_mutex);  // check and add at once
+        admission = checkAdmission((double)sample_count(job) / WHISPER_SAMPLE_RATE, admissionBytes(sample_count(job)));
+        if (!admission.accepted) {
+            rejected_jobs++;
+            log.debug("job rejected by admission limit: {}", admission.reason);
+            return std::nullopt;
+        }
+        return add(std::move(job));
+    }
+
     bool abort(WhisperJobID id) {
-        for (auto& pair : threads) {
-            auto& data = pair.second;
-            auto job_id = data.job_id;
-            if (job_id != nullptr && *job_id == id) {
+        // flag the job first: a processor that picks it up afterwards sees the flag, one that already has it is flagged below
+        if (auto job = getJob(id); job) {
+            log.trace("setting abort flag for job {}", job->id);
+            job->do_abort = true;
+        }
+        for (auto& data : threads) {   // the pool is fixed, only the current job of each thread needs locking
+            std::lock_guard<std::mutex> lock(data->mutex);
+            if (data->job != nullptr && data->job->id == id) {
                 log.trace("setting abort flag for running process");
-                data.do_abort = true;
-                return true;
+                data->do_abort = true;  // a split job may run on several processors
             }
         }
-        if (auto opt = getJob(id); opt) {
-            std::shared_lock<std::shared_mutex> lock(job_status_mutex);
-            log.trace("setting abort flag for job {}", opt.value().id);
-            return opt.value().do_abort = true;
-        }
         return true;
     }
 
     std::optional<WhisperJobStatus> getJobStatus(WhisperJobID id) {
-        if (auto opt = getJob(id); opt) {
+        if (auto job = getJob(id); job) {
             std::shared_lock<std::shared_mutex> lock(job_status_mutex);
-            return opt.value().status;
+            return job->status;
         }
         return std::nullopt;
     }
 
-    optional_ref<const WhisperSegments> getResults(WhisperJobID id) {
-        if (auto opt = getJob(id); opt) {
-            auto& job = opt.value();
+    // the returned pointer keeps the job results alive even if the job is evicted meanwhile
+    std::shared_ptr<const WhisperSegments> getResults(WhisperJobID id) {
+        if (auto job = getJob(id); job) {
             // {
             //     std::shared_lock<std::shared_mutex> lock(job_status_mutex);
             //     if (job.status != WhisperJobStatus::Done)
             //         return std::nullopt;
             // }
-            return job.segments;
+            return std::shared_ptr<const WhisperSegments>(job, &job->segments);
         }
-        return std::nullopt;
+        return nullptr;
     }
 
-private:
-    optional_ref<WhisperJobInternal> getJob(WhisperJobID id) {
-        std::shared_lock<std::shared_mutex> lock(jobs_mutex);
-        auto it = jobs.find(id);
-        if (it == jobs.end())
+    void setRetention(int ttl_s, size_t max_bytes) {
+        retention_ttl_ms = (int64_t)ttl_s * 1000;
+        retention_max_bytes = max_bytes;
+    }
+
+    void setSpill(WhisperQueueProcessor::SpillStore store, WhisperQueueProcessor::SpillLoad load) {
+        spill_store = std::move(store);
+        spill_load = std::move(load);
+    }
+
+    void setAudioSpill(const std::string& directory, size_t max_resident_bytes) {
+        namespace fs = std::filesystem;
+        std::error_code ec;
+        fs::create_directories(directory, ec);
+        if (ec) {
+            log.error("unable to create directory {} for queued audio: {}", directory, ec.message());
+            return;
+        }
+        // leftovers of jobs that were waiting when the server stopped
+        for (auto& entry : fs::directory_iterator(directory, ec)) {
+            if (entry.path().extension() == ".s16")
+                fs::remove(entry.path(), ec);
+        }
+        audio_spill_dir = directory;
+        max_resident_audio_bytes = max_resident_bytes;
+    }
+
+    void setScheduling(WhisperSchedulingPolicy policy, bool fair_share, double aging) {
+        scheduler.configure(policy, fair_share, aging);
+    }
+
+    void setPreemption(bool enable, double short_job_s, double min_run_s) {
+        scheduler.configurePreemption(enable, short_job_s, min_run_s);
+    }
+
+    std::optional<WhisperJobQueueInfo> getQueueInfo(WhisperJobID id) {
+        auto job = getJob(id);
+        if (!job)
             return std::nullopt;
-        return it->second;
+        {
+            std::shared_lock<std::shared_mutex> lock(job_status_mutex);
+            if (job->status != WhisperJobStatus::Waiting)
+                return std::nullopt;
+        }
+
+        std::vector<std::shared_ptr<WhisperJobInternal>> queued;  // keeps jobs alive while ordering
+        work_queue.for_each([&](const WhisperWorkItem& item) {
+            if (!item.range)
+                queued.push_back(item.job);
+        });
+
+        std::vector<const WhisperJobInternal*> jobs;
+        for (auto& queued_job : queued)
+            jobs.push_back(queued_job.get());
+
+        auto order = scheduler.order(std::move(jobs));
+        auto it = std::find(order.begin(), order.end(), job.get());
+        if (it == order.end())
+            return std::nullopt;    // just picked up by a processor
+
+        std::vector<const WhisperJobInternal*> ahead(order.begin(), it);
+
+        WhisperJobQueueInfo info;
+        info.position = ahead.size();
+        info.eta_s = scheduler.estimate(ahead, max_instances);
+        return info;
     }
 
-    WhisperJobID newJobID() { return rnd(6); }
+    WhisperQueueStats getStats() {
+        WhisperQueueStats stats;
+        {
+            std::shared_lock<std::shared_mutex> lock(jobs_mutex);
+            stats.jobs = jobs.size();
+        }
+        stats.retained_bytes = retained_bytes.load();
+        stats.evicted = evicted_jobs.load();
+        stats.spilled = spilled_jobs.load();
+        stats.restored = restored_jobs.load();
+        stats.preempted = preempted_jobs.load();
+        stats.rejected = rejected_jobs.load();
+        stats.spilled_audio = spilled_audio_jobs.load();
+        {
+            std::lock_guard<std::mutex> lock(admission_mutex);
+            stats.queued_jobs = queued_totals.jobs;
+            stats.queued_audio_s = queued_totals.audio_s;
+            stats.queued_bytes = queued_totals.bytes;
+        }
+        return stats;
+    }
+
+private:
+    std::shared_ptr<WhisperJobInternal> getJob(WhisperJobID id) {
+        {
+            std::shared_lock<std::shared_mutex> lock(jobs_mutex);
+            auto it = jobs.find(id);
+            if (it != jobs.end()) {
+                it->second->last_access_ms = now_ms();
+                return it->second;
+            }
+        }
+        return restore(id);
+    }
+
+    // would the audio of a new waiting job exceed the memory budget of waiting jobs
+    bool overResidentBudget(size_t bytes) {
+        if (audio_spill_dir.empty() || bytes == 0)
+            return false;
+        std::lock_guard<std::mutex> lock(admission_mutex);
+        return queued_totals.bytes + bytes > max_resident_audio_bytes;
+    }
+
+    // memory counted against the limits for a job of the given samples, audio that will be spilled to a file is not held in memory
+    size_t admissionBytes(size_t samples) {
+        size_t bytes = samples * sizeof(int16_t);
+        return overResidentBudget(bytes) ? 0 : bytes;
+    }
+
+    // the samples are written to a file and freed, so that only the disk bounds the queue
+    bool spillAudio(WhisperJobInternal& job) {
+        std::lock_guard<std::mutex> lock(job.audio_mutex);
+        std::string path = (std::filesystem::path(audio_spill_dir) / (job.id + ".s16")).string();
+        size_t count = job.samples_s16.count;
+        {
+            std::ofstream file(path, std::ios::binary);
+            file.write((const char*)job.samples_s16.data, count * sizeof(int16_t));
+            if (!file.good()) {
+                log.warn("unable to write audio of job {} to {}, keeping it in memory", job.id, path);
+                file.close();
+                std::remove(path.c_str());
+                return false;
+            }
+        }
+        job.audio_file = path;
+        job.audio_count = count;
+        job.samples_s16.free();
+        spilled_audio_jobs++;
+        log.debug("job {}: {} bytes of audio written to {}", job.id, count * sizeof(int16_t), path);
+        return true;
+    }
 
-    bool start_thread() {
-        std::thread thread(std::bind(&WhisperQueueProcessorImpl::processor, this /*, ...arguments */));
-        std::lock_guard<std::mutex> lock(threads_mutex);
-        threads[thread.get_id()].thread = std::move(thread);
-        // thread_job_mutexes.emplace(thread.get_id(), std::shared_mutex());
-        // thread_job_mutexes[thread.get_id()];  // default construct shared_mutext in place
+    // maps spilled audio back when the job starts; its pages are read ahead sequentially and can be dropped under
+    // memory pressure, the file is unlinked right away and lives on until the mapping is released with the job
+    bool loadAudio(WhisperJobInternal& job) {
+        std::lock_guard<std::mutex> lock(job.audio_mutex);
+        if (job.audio_file.empty())
+            return true;
+        size_t size = job.audio_count * sizeof(int16_t);
+        int fd = ::open(job.audio_file.c_str(), O_RDONLY);
+        if (fd < 0) {
+            log.error("unable to open audio of job {} at {}", job.id, job.audio_file);
+            return false;
+        }
+        void* data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        job.removeAudioFile();
+        if (data == MAP_FAILED) {
+            log.error("unable to map audio of job {}", job.id);
+            return false;
+        }
+        madvise(data, size, MADV_SEQUENTIAL);
+        job.samples_s16 = SharedBuffer<int16_t>((int16_t*)data, [size](int16_t* data) { munmap(data, size); }, job.audio_count);
+        job.audio_mapped = true;
         return true;
     }
 
-    optional_ref<WhisperJobInternal> getNextJob() {
-        if (job_queue.empty())
-            return std::nullopt;
-        std::lock_guard<std::mutex> lock(job_queue_mutex);
-        WhisperJobID id = job_queue.front();
-        job_queue.pop();
-        WhisperJobInternal& job = jobs.at(id);
+    // admission totals of waiting jobs
+    void enqueued(WhisperJobInternal& job) {
+        std::lock_guard<std::mutex> lock(admission_mutex);
+        if (job.queued)
+            return;
+        job.queued = true;
+        job.queued_audio_s = job.duration_s;
+        // spilled and mapped audio does not count against the memory of waiting jobs
+        job.queued_bytes = job.audio_mapped ? 0 : job.samples_s16.count * sizeof(int16_t);
+        queued_totals.jobs++;
+        queued_totals.audio_s += job.queued_audio_s;
+        queued_totals.bytes += job.queued_bytes;
+    }
+
+    void dequeued(WhisperJobInternal& job) {
+        std::lock_guard<std::mutex> lock(admission_mutex);
+        if (!job.queued)
+            return;
+        job.queued = false;
+        queued_totals.jobs--;
+        queued_totals.audio_s = std::max(0.0, queued_totals.audio_s - job.queued_audio_s);
+        queued_totals.bytes -= std::min(queued_totals.bytes, job.queued_bytes);
+    }
+
+    // status transitions wake all waiters of the job
+    void setStatus(WhisperJobInternal& job, WhisperJobStatus status) {
+        std::unique_lock<std::shared_mutex> lock(job_status_mutex);
+        job.events.update([&] { job.status = status; });
+    }
+
+    static int64_t now_ms() {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    // rough estimate of memory held by job results
+    static size_t resultBytes(const WhisperSegments& segments) {
+        size_t bytes = segments.capacity() * sizeof(WhisperSegment);
+        for (auto& segment : segments) {
+            bytes += segment.text.capacity() + segment.lang.capacity() + segment.tokens.capacity() * sizeof(WhisperToken);
+            for (auto& token : segment.tokens)
+                bytes += token.text.capacity();
+        }
+        return bytes;
+    }
+
+    // called by the processor when the job reaches a terminal state: audio is not needed anymore;
+    // the final status is published together with the finished flag, so eviction never sees a finished running job
+    void finish(WhisperJobInternal& job, WhisperJobStatus status) {
+        job.free();
+        job.split.results.clear();
+        job.split.results.shrink_to_fit();
+        job.result_bytes = resultBytes(job.segments);
+        job.finished_ms = now_ms();
+        job.last_access_ms = job.finished_ms;
+
+        std::unique_lock<std::shared_mutex> lock(job_status_mutex);
+        job.events.update([&] {
+            job.status = status;
+            job.finished = true;
+        });
+    }
+
+    // drop finished jobs past TTL, then least recently used ones until the results fit into the byte budget
+    void evict() {
+        if (retention_ttl_ms <= 0 && retention_max_bytes == 0)
+            return;
+
+        std::lock_guard<std::mutex> evict_lock(evict_mutex);
+
+        int64_t now = now_ms();
+        size_t total = 0;
+        std::vector<std::shared_ptr<WhisperJobInternal>> victims;
+
+        {
+            std::shared_lock<std::shared_mutex> lock(jobs_mutex);
+            std::vector<std::shared_ptr<WhisperJobInternal>> retained;
+            for (auto& [id, job] : jobs) {
+                if (!job->finished)
+                    continue;
+                if (retention_ttl_ms > 0 && now - job->finished_ms > retention_ttl_ms) {
+                    victims.push_back(job);
+                    continue;
+                }
+                total += job->result_bytes;
+                retained.push_back(job);
+            }
+            if (retention_max_bytes > 0 && total > retention_max_bytes) {
+                std::sort(retained.begin(), retained.end(), [](const auto& a, const auto& b) { return a->last_access_ms < b->last_access_ms; });
+                for (auto& job : retained) {
+                    if (total <= retention_max_bytes)
+                        break;
+                    total -= job->result_bytes;
+                    victims.push_back(job);
+                }
+            }
+        }
+
+        retained_bytes = total;
+
+        if (victims.empty())
+            return;
+
+        // store before erasing, so that the job is always found either in memory or in the spill storage
+        for (auto& job : victims) {
+            if (spill_store && !job->spilled) {
+                if (spill_store(job->id, job->status, job->segments))
+                    spilled_jobs++;
+                else
+                    log.warn("failed to spill results of job {}", job->id);
+            }
+        }
+
+        {
+            std::unique_lock<std::shared_mutex> lock(jobs_mutex);
+            for (auto& job : victims)
+                jobs.erase(job->id);
+        }
+
+        evicted_jobs += victims.size();
+
+        log.debug("evicted {} finished job(s), {} bytes of results retained", victims.size(), total);
+    }
+
+    // load an evicted job back from the spill storage
+    std::shared_ptr<WhisperJobInternal> restore(WhisperJobID id) {
+        if (!spill_load)
+            return nullptr;
+
+        auto r = spill_load(id);
+        if (!r)
+            return nullptr;
+
+        auto job = std::make_shared<WhisperJobInternal>(WhisperJob());
+        job->id = id;
+        job->status = r->first;
+        job->segments = std::move(r->second);
+        job->spilled = true;
+        finish(*job, r->first);
+
+        {
+            std::unique_lock<std::shared_mutex> lock(jobs_mutex);
+            auto [it, inserted] = jobs.emplace(id, job);
+            if (!inserted)
+                return it->second;
+        }
+
+        restored_jobs++;
+
+        log.debug("restored job {} from spill storage", id);
+
         return job;
     }
 
+    WhisperJobID newJobID() { return rnd(6); }
+
+    // fixed pool of long-lived processor threads, each with its own whisper instance
+    void start() {
+        work_queue.set_selector([this](const std::deque<WhisperWorkItem>& items, size_t first) { return scheduler.select(items, first); });
+        for (int i = 0; i < max_instances; i++)
+            threads.emplace_back(std::make_unique<WhisperProcessingThreadData>());
+        for (auto& data : threads)
+            data->thread = std::thread(&WhisperQueueProcessorImpl::processor, this, std::ref(*data));
+        log.debug("started {} processor thread(s)", threads.size());
+    }
+
+    // abort running jobs, queued jobs are left unprocessed
+    void stop() {
+        stopping = true;
+        work_queue.close();
+        for (auto& data : threads)
+            data->do_abort = true;
+        for (auto& data : threads)
+            if (data->thread.joinable())
+                data->thread.join();
+    }
+
+    // remaining speech ranges of the given split job
+    std::optional<WhisperRangeTask> takeRangeTask(const WhisperJobInternal* job) {
+        if (auto item = work_queue.take_if([&](const WhisperWorkItem& item) { return item.range && item.range->job.get() == job; }); item)
+            return std::move(item->range);
+        return std::nullopt;
+    }
+
+    void setCurrentJob(WhisperProcessingThreadData& data, const WhisperJobInternal* job) {
+        std::lock_guard<std::mutex> lock(data.mutex);
+        data.job = job;
+        data.do_abort = false;
+    }
+
+    // transcribe a single speech range of a split job
+    void processRange(WhisperImpl& whisper, WhisperProcessingThreadData& data, const WhisperRangeTask& task) {
+        WhisperJobInternal& job = *task.job;
+
+        bool skip = false;
+        {
+            std::shared_lock<std::shared_mutex> lock(job.events.mutex);
+            skip = job.split.failed || job.split.aborted || job.do_abort || data.do_abort;
+        }
+
+        int exit_code = 0;
+        WhisperSegments segments;
+
+        if (!skip) {
+            WhisperJobConfig config = job.config;
+            config.use_vad = false;
+            config.reset = true;    // previous range is not guaranteed to be transcribed yet, so no text context
+
+            const auto& window = task.window;
+
+            log.trace("job {} range {}: transcribing {} ms from {} ms", job.id, task.index,
+                    (int64_t)window.size() * 1000 / window.sample_rate, (int64_t)window.start() * 1000 / window.sample_rate);
+
+            std::vector<float> packed;
+
+            auto r = whisper(window.data(job.samples_s16.data, packed), window.size(), config, [&](WhisperSegments&& new_segments) -> bool {
+                whisper.mapSegments(new_segments, window);
+                segments.insert(segments.end(), std::make_move_iterator(new_segments.begin()), std::make_move_iterator(new_segments.end()));
+                return !data.do_abort && !job.do_abort;
+            });
+            exit_code = r.exit_code;
+
+            whisper.release();
+        }
+
+        WhisperReturnValue r = exit_code;
+
+        job.events.update([&] {
+            if (!r) {
+                if (r.aborted())
+                    job.split.aborted = true;
+                else
+                    job.split.failed = true;
+            }
+
+            job.split.results[task.index] = std::move(segments);
+            job.split.done[task.index] = true;
+
+            // append the completed ordered prefix, so that waiters can stream it right away
+            while (job.split.emitted < job.split.done.size() && job.split.done[job.split.emitted]) {
+                auto& results = job.split.results[job.split.emitted];
+                job.segments.insert(job.segments.end(), std::make_move_iterator(results.begin()), std::make_move_iterator(results.end()));
+                results.clear();
+                job.split.emitted++;
+            }
+
+            job.split.pending--;
+        });
+    }
+
+    // drop a speech range that will not be transcribed, e.g. when stopping
+    void cancelRange(const WhisperRangeTask& task) {
+        WhisperJobInternal& job = *task.job;
+
+        job.events.update([&] {
+            job.split.aborted = true;
+            job.split.done[task.index] = true;
+            job.split.pending--;
+        });
+    }
+
+    // run VAD on the job and dispatch its speech ranges to all free processor instances
+    WhisperReturnValue processSplit(WhisperImpl& whisper, WhisperProcessingThreadData& data, const std::shared_ptr<WhisperJobInternal>& job_ptr) {
+        WhisperJobInternal& job = *job_ptr;
+
+        VAD vad(vad_model, job.config.vad_config);
+
+        const auto& config = job.config;
+
+        SpeechWindowPacker packer(vad.sample_rate(), config.pack_window_ms, config.pack_gap_ms, config.reset_min_nospeech_ms);
+
+        size_t dispatched = 0;
+
+        const auto dispatch = [&](SpeechWindow&& window) -> bool {
+            WhisperRangeTask task{ job_ptr, 0, std::move(window) };
+
+            bool ended = false;
+            job.events.update([&] {
+                if (job.split.failed || job.split.aborted) {
+                    ended = true;
+                    return;
+                }
+                task.index = job.split.results.size();
+                job.split.results.emplace_back();
+                job.split.done.push_back(false);
+                job.split.pending++;
+            });
+            if (ended)
+                return false;
+
+            if (!work_queue.push(WhisperWorkItem{ job_ptr, std::move(task) }, true /* ranges of running jobs go before new jobs */)) {
+                // the queue is closed, nobody is going to take this range
+                job.events.update([&] {
+                    job.split.aborted = true;
+                    job.split.results.pop_back();   // only this thread dispatches, so the range is still the last one
+                    job.split.done.pop_back();
+                    job.split.pending--;
+                });
+                return false;
+            }
+
+            dispatched++;
+
+            return true;
+        };
+
+        bool stopped = false;
+
+        const auto add = [&](const speech_range& sr) -> bool {
+            if (data.do_abort || job.do_abort) {
+                stopped = true;
+                return false;
+            }
+
+            if (!config.pack_ranges) {
+                stopped = !dispatch(SpeechWindow(sr, vad.sample_rate()));
+            } else if (auto w = packer.add(sr); w) {
+                stopped = !dispatch(std::move(w.value()));
+            }
+
+            return !stopped;
+        };
+
+        std::string key = vad_cache ? vad.cache_key(job.samples_s16.data, job.samples_s16.count) : "";
+
+        bool vad_failed = false;
+
+        if (auto cached = vad_cache ? vad_cache->get(key) : std::nullopt; cached) {
+            log.debug("job {}: reusing {} cached VAD ranges", job.id, cached->size());
+            for (auto& sr : cached.value()) {
+                if (!add(sr))
+                    break;
+            }
+        } else {
+            std::vector<speech_range> detected;
+
+            try {
+                vad.start(job.samples_s16.data, job.samples_s16.count);
+
+                for (auto& sr : vad) {
+                    detected.push_back(sr);
+                    if (!add(sr))
+                        break;
+                }
+            } catch (const std::exception& e) {
+                log.error("job {}: VAD failed: {}", job.id, e.what());
+                vad_failed = stopped = true;
+                // the dispatched ranges are not needed anymore
+                job.events.update([&] { job.split.failed = true; });
+            }
+
+            if (vad_cache && !stopped)
+                vad_cache->put(key, detected);
+        }
+
+        if (!stopped && config.pack_ranges) {
+            if (auto w = packer.flush(); w)
+                dispatch(std::move(w.value()));
+        }
+
+        log.debug("job {}: {} speech range(s) dispatched", job.id, dispatched);
+
+        // help with the remaining ranges of this job
+        while (auto task = takeRangeTask(&job))
+            processRange(whisper, data, task.value());
+
+        // wait for the ranges still running on other instances
+        {
+            std::unique_lock<std::shared_mutex> lock(job.events.mutex);
+            job.events.cv.wait(lock, [&] { return job.split.pending == 0; });
+        }
+
+        if (vad_failed)
+            return -102;
+        if (data.do_abort || job.do_abort || job.split.aborted)
+            return -6;
+        if (job.split.failed)
+            return -1;
+        return 0;
+    }
+
     // std::shared_mutex& get_thread_job_mutex(std::thread::id id = std::this_thread::get_id()) {
     //     std::lock_guard<std::mutex> lock(threads_mutex);
     //     return thread_job_mutexes[id];
     // }
 
-    WhisperProcessingThreadData& get_thread(std::thread::id id = std::this_thread::get_id()) {
-        std::lock_guard<std::mutex> lock(threads_mutex);
-        return threads[id];
-    }
-
-    void processor() {
-        active_threads++;
-
-        // std::shared_mutex& job_mutex = get_thread_job_mutex();
-        WhisperProcessingThreadData& data = get_thread();
-        std::shared_mutex& job_mutex = data.job_mutex;
-        std::condition_variable_any& job_cv = data.cv;
+    void processor(WhisperProcessingThreadData& data) {
 
         WhisperImpl whisper(model, vad_model);
         WhisperJobInternal* currentJob = nullptr;
@@ -1100,42 +2406,59 @@ private:
 
         const auto newSegmentsCallback = [&](WhisperSegments&& segments) -> bool {
             WhisperJobInternal& job = *currentJob;
-            // std::shared_mutex& mutex = *job.mutex;
-            // std::condition_variable_any& cv = *job.cv;
-            std::shared_mutex& mutex = job.mutex.ref();
-            std::condition_variable_any& cv = job.cv.ref();
-
-            {
-                std::unique_lock<std::shared_mutex> lock(mutex);
 
+            job.events.update([&] {
                 job.segments.insert(job.segments.end(),
                        std::make_move_iterator(segments.begin()),
                        std::make_move_iterator(segments.end()));
                 segments.clear(); // clear the source vector as its elements have been moved
-            }
+            });
 
                 // spdlog::info("processor()::new segment callback: job segments {}", job.segments.size());
 
-            job_cv.notify_all();
-
             if (data.do_abort)
                 return false;
 
             return true;
         };
-        while (auto nextJob = getNextJob()) {
-            WhisperJobInternal& job = nextJob.value();
+        while (auto work = work_queue.pop()) {
+            if (stopping) {
+                // the split coordinator waits for its ranges, so release them before leaving
+                if (work->range)
+                    cancelRange(work->range.value());
+                while (auto task = work_queue.take_if([](const WhisperWorkItem& item) { return item.range.has_value(); }))
+                    cancelRange(task->range.value());
+                break;
+            }
+
+            setCurrentJob(data, work->job.get());
+            whisper.resetAbort();
+
+            if (work->range) {
+                processRange(whisper, data, work->range.value());
+                setCurrentJob(data, nullptr);
+                continue;
+            }
+
+            WhisperJobInternal& job = *work->job;
             currentJob = &job;
 
+            dequeued(job);
+
             if (job.do_abort || job.status == WhisperJobStatus::Aborted) {
-                std::unique_lock<std::shared_mutex> lock(job_status_mutex);
-                job.status = WhisperJobStatus::Aborted;
+                finish(job, WhisperJobStatus::Aborted);
+                setCurrentJob(data, nullptr);
+                continue;
+            }
+
+            if (!loadAudio(job)) {
+                finish(job, WhisperJobStatus::Failed);
+                setCurrentJob(data, nullptr);
                 continue;
             }
 
-            // with what to lock?
-            data.do_abort = false;
-            data.job_id = &job.id;
+            whisper.setVADModel(vad_model);
+            whisper.setVADCache(vad_cache);
 
             // spdlog::info("processor() got job with id = {}", job.id);
 
@@ -1153,42 +2476,68 @@ private:
             //     spdlog::info("processor() job.config.lang.c_str = {}", (size_t)job.config.lang.c_str());
             // job.cv = &job_cv;
             //     spdlog::info("processor() job.config.lang = {}", job.config.lang);
-            job.mutex = job_mutex;
-            job.cv = job_cv;
-            auto mutex_keeper = job.mutex.scoped();
-            auto cv_keeper = job.cv.scoped();
-            {
-                std::unique_lock<std::shared_mutex> lock(job_status_mutex);
-                job.status = WhisperJobStatus::Running;
-            }
+            setStatus(job, WhisperJobStatus::Running);
+            scheduler.started(job);
                 // spdlog::info("processor() job.config.lang = {}", job.config.lang);
 
-            auto r = whisper(job.samples.data, job.samples.count, job.config, newSegmentsCallback);
+            // checked at VAD window boundaries of sequentially processed jobs
+            const auto preempt = [&]() -> bool {
+                std::vector<std::shared_ptr<WhisperJobInternal>> queued;
+                work_queue.for_each([&](const WhisperWorkItem& item) {
+                    if (!item.range)
+                        queued.push_back(item.job);
+                });
+                if (queued.empty())
+                    return false;
+                std::vector<const WhisperJobInternal*> waiting;
+                for (auto& queued_job : queued)
+                    waiting.push_back(queued_job.get());
+                return scheduler.shouldPreempt(job, waiting);
+            };
+
+            auto r = split_ranges && job.config.use_vad && vad_model ?
+                processSplit(whisper, data, work->job) :
+                whisper(job.samples_s16.data, job.samples_s16.count, job.config, newSegmentsCallback, &job.progress, preempt);
+
+            whisper.release();  // results are already collected, give the state back to the pool
+
+            if (r.preempted()) {
+                // back to the queue, segments so far stay with the job and waiters keep waiting
+                log.info("job {} preempted, {:.1f} s of audio remaining", job.id, (double)(job.samples_s16.count - job.progress.resume_sample) / WHISPER_SAMPLE_RATE);
+                scheduler.finished(job, false);
+                job.duration_s = (double)(job.samples_s16.count - job.progress.resume_sample) / WHISPER_SAMPLE_RATE;
+                setStatus(job, WhisperJobStatus::Waiting);
+                setCurrentJob(data, nullptr);
+                currentJob = nullptr;
+                preempted_jobs++;
+                enqueued(job);
+                if (!work_queue.push(WhisperWorkItem{ work->job })) {
+                    // the queue is closed on shutdown, the job would never be resumed
+                    dequeued(job);
+                    finish(job, WhisperJobStatus::Aborted);
+                    work.reset();
+                }
+                continue;
+            }
+
+            scheduler.finished(job, (bool)r);
 
+            // results are not modified anymore, waiters see the final status together with the finished job
             if (r) {
-                std::unique_lock<std::shared_mutex> lock(job_status_mutex);
-                job.status = WhisperJobStatus::Done;
+                finish(job, WhisperJobStatus::Done);
                 // put into done jobs
-                // get final result and notify
             } else {
-                std::unique_lock<std::shared_mutex> lock(job_status_mutex);
                 if (r.aborted())
-                    job.status = WhisperJobStatus::Aborted;
+                    finish(job, WhisperJobStatus::Aborted);
                 else
-                    job.status = WhisperJobStatus::Failed;
+                    finish(job, WhisperJobStatus::Failed);
                 // put into failed jobs, TODO: how to get and store reason?
             }
-            job_cv.notify_all();  // unlock all waiters, allow them to finish
-            // job.mutex = nullptr;
-            // TODO: with what mutex to lock
-            data.job_id = nullptr;
-        }
-        active_threads--;
-        // remove itself from the threads list
-        {
-            // std::lock_guard<std::mutex> lock(threads_mutex);
-            // threads.erase(std::this_thread::get_id());
-            // thread_job_mutexes.erase(std::this_thread::get_id());
+            setCurrentJob(data, nullptr);
+            currentJob = nullptr;
+            work.reset();   // release the job, it may be evicted from now on
+
+            evict();
         }
     }
 
@@ -1196,25 +2545,52 @@ private:
 
     // std::map<int, std::shared_ptr<WhisperImpl>> pool;
 
-    std::atomic_int active_threads = 0;
-
     int next_whisper_id = 0;
     int next_job_id = 0;
     int max_instances = 2;
+    std::atomic_bool split_ranges = false;
+    std::atomic_bool stopping = false;
     // input job queue -> contains job definition
     // job id -> state
     //
     // already done objects and shared results (at the time of done all registered callbacks got done signal) -> archive into sqlite db
     // std::queue<WhisperJob> job_queue;
-    std::mutex job_queue_mutex;
-    std::queue<WhisperJobID> job_queue;
+    BlockingQueue<WhisperWorkItem> work_queue;  // new jobs, speech ranges of running split jobs are queued with priority
+    WhisperJobScheduler scheduler;              // picks the next new job from the work queue
     // will this container act as some job keeper? need to determine job by status then
 
     std::shared_mutex jobs_mutex;
-    std::unordered_map<WhisperJobID, WhisperJobInternal> jobs;  // the main in memory storage of jobs, references to values are valid until removed
-
-    std::mutex threads_mutex;
-    std::map<std::thread::id, WhisperProcessingThreadData> threads;
+    std::unordered_map<WhisperJobID, std::shared_ptr<WhisperJobInternal>> jobs;  // the main in memory storage of jobs, finished jobs are evicted by the retention policy
+
+    // retention of finished jobs
+    int64_t retention_ttl_ms = 0;       // 0 - keep forever
+    size_t retention_max_bytes = 0;     // 0 - unlimited
+    std::mutex evict_mutex;
+    std::atomic<size_t> retained_bytes = 0;
+    std::atomic<size_t> evicted_jobs = 0;
+    std::atomic<size_t> spilled_jobs = 0;
+    std::atomic<size_t> restored_jobs = 0;
+    std::atomic<size_t> preempted_jobs = 0;
+
+    // admission control over waiting jobs
+    std::mutex admit_mutex;
+    std::mutex admission_mutex;     // guards limits and totals
+    size_t max_queued_jobs = 0;     // 0 - unlimited
+    double max_queued_audio_s = 0;
+    size_t max_queued_bytes = 0;
+    struct {
+        size_t jobs = 0;
+        double audio_s = 0;
+        size_t bytes = 0;
+    } queued_totals;
+    std::atomic<size_t> rejected_jobs = 0;
+    std::string audio_spill_dir;            // empty - audio of waiting jobs stays in memory
+    size_t max_resident_audio_bytes = 0;
+    std::atomic<size_t> spilled_audio_jobs = 0;
+    WhisperQueueProcessor::SpillStore spill_store;
+    WhisperQueueProcessor::SpillLoad spill_load;
+
+    std::vector<std::unique_ptr<WhisperProcessingThreadData>> threads;     // fixed after start()
     // std::map<std::thread::id, std::thread> threads;
     // std::map<std::thread::id, std::shared_mutex> thread_job_mutexes;
 
@@ -1242,17 +2618,40 @@ Whisper WhisperQueueProcessor::newWhisperInstance() {
 }
 
 void WhisperQueueProcessor::setVADModel(VADModel& vad_model) { if (impl) impl->setVADModel(vad_model); }
+void WhisperQueueProcessor::setVADCache(std::shared_ptr<VADRangeCache> cache) { if (impl) impl->setVADCache(cache); }
+
+void WhisperQueueProcessor::setSplitRanges(bool enable) { if (impl) impl->setSplitRanges(enable); }
 
 WhisperJobID WhisperQueueProcessor::add(WhisperJob&& job) { return impl->add(std::move(job)); }
 
+void WhisperQueueProcessor::setAdmissionLimits(size_t max_jobs, double max_audio_s, size_t max_bytes) { impl->setAdmissionLimits(max_jobs, max_audio_s, max_bytes); }
+
+WhisperAdmission WhisperQueueProcessor::checkAdmission(double audio_s) { return impl->checkAdmission(audio_s); }
+
+std::optional<WhisperJobID> WhisperQueueProcessor::tryAdd(WhisperJob&& job, WhisperAdmission& admission) { return impl->tryAdd(std::move(job), admission); }
+
 std::optional<WhisperJobStatus> WhisperQueueProcessor::wait(WhisperJobID id, const std::function<bool(const WhisperSegments&, size_t)>& callback) { return impl->wait(id, callback); }
 
 std::optional<WhisperJobStatus> WhisperQueueProcessor::getJobStatus(WhisperJobID id) { return impl->getJobStatus(id); }
 
-optional_ref<const WhisperSegments> WhisperQueueProcessor::getResults(WhisperJobID id) {
+std::shared_ptr<const WhisperSegments> WhisperQueueProcessor::getResults(WhisperJobID id) {
     return impl->getResults(id);
 }
 
+void WhisperQueueProcessor::setRetention(int ttl_s, size_t max_bytes) { impl->setRetention(ttl_s, max_bytes); }
+
+void WhisperQueueProcessor::setSpill(SpillStore store, SpillLoad load) { impl->setSpill(std::move(store), std::move(load)); }
+
+void WhisperQueueProcessor::setAudioSpill(const std::string& directory, size_t max_resident_bytes) { impl->setAudioSpill(directory, max_resident_bytes); }
+
+WhisperQueueStats WhisperQueueProcessor::getStats() { return impl->getStats(); }
+
+void WhisperQueueProcessor::setPreemption(bool enable, double short_job_s, double min_run_s) { impl->setPreemption(enable, short_job_s, min_run_s); }
+
+void WhisperQueueProcessor::setScheduling(WhisperSchedulingPolicy policy, bool fair_share, double aging) { impl->setScheduling(policy, fair_share, aging); }
+
+std::optional<WhisperJobQueueInfo> WhisperQueueProcessor::getQueueInfo(WhisperJobID id) { return impl->getQueueInfo(id); }
+
 bool WhisperQueueProcessor::abort(WhisperJobID id) {
     return impl->abort(id);
 }
@@ -1,6 +1,9 @@
 #pragma once
 
 #include <string>
+#include <memory>
+#include <functional>
+#include <optional>
 
 #include <nlohmann/json.hpp>
 #include <msgpack/msgpack.hpp>
@@ -76,6 +79,23 @@ struct WhisperToken {
 
     nlohmann::json to_json() const { return nlohmann::json::from_msgpack(msgpack::pack(const_cast<WhisperToken&>(*this))); }
 
+    static WhisperToken from_json(const nlohmann::json& j) {
+        WhisperToken token;
+        token.id = j.value("id", 0);
+        token.tid = j.value("tid", 0);
+        token.p = j.value("p", 0.0f);
+        token.plog = j.value("plog", 0.0f);
+        token.pt = j.value("pt", 0.0f);
+        token.ptsum = j.value("ptsum", 0.0f);
+        token.t0 = j.value("start", (int64_t)0);
+        token.t1 = j.value("end", (int64_t)0);
+        token.t_dtw = j.value("t_dtw", (int64_t)-1);
+        token.vlen = j.value("vlen", 0.0f);
+        token.special = j.value("special", false);
+        token.text = j.value("text", std::string());
+        return token;
+    }
+
 private:
     void operator+=(const WhisperToken& other) {
         // t0
@@ -127,6 +147,19 @@ struct WhisperSegment {
     }
 
     nlohmann::json to_json() const { return nlohmann::json::from_msgpack(msgpack::pack(const_cast<WhisperSegment&>(*this))); }
+
+    static WhisperSegment from_json(const nlohmann::json& j) {
+        WhisperSegment segment;
+        segment.t0 = j.value("start", (int64_t)0);
+        segment.t1 = j.value("end", (int64_t)0);
+        segment.text = j.value("text", std::string());
+        segment.turn_next = j.value("turn_next", false);
+        segment.lang = j.value("lang", std::string());
+        if (j.contains("tokens") && j["tokens"].is_array())
+            for (auto& token : j["tokens"])
+                segment.tokens.emplace_back(WhisperToken::from_json(token));
+        return segment;
+    }
 };
 
 typedef std::vector<WhisperSegment> WhisperSegments;
@@ -155,6 +188,9 @@ public:
     const int exit_code;
     operator bool() const { return exit_code == 0; }
     bool aborted() const { return exit_code == -6; }
+    bool unavailable() const { return exit_code == -101; }  // no free whisper state in the pool
+    bool preempted() const { return exit_code == -7; }      // stopped at a range boundary to be resumed later
+    bool vad_failed() const { return exit_code == -102; }   // speech detection failed, no transcription
 };
 
 class WhisperModel {
@@ -174,6 +210,9 @@ public:
 
     bool init(const std::string& model, const std::string& dtw = "", bool use_gpu = true, int gpu_device = 0);
 
+    // limit the number of whisper states (max_states <= 0 - unlimited) shared by all Whisper instances and the queue processor
+    void configureStatePool(int max_states, int prewarm = 0);
+
 private:
     friend class Whisper;
     friend class WhisperQueueProcessor;
@@ -190,6 +229,15 @@ struct WhisperJobConfig {
     int duration_ms = 0;        // audio duration to process in ms
     int reset_min_nospeech_ms = 10000;  // 10s
     VADConfig vad_config = VADConfig();
+    int vad_queue_ranges = 32;  // speech ranges the VAD thread may detect ahead of transcription
+    int state_wait_ms = -1;     // wait for a free whisper state: -1 - indefinitely, 0 - fail immediately
+    bool pack_ranges = false;   // pack short VAD speech ranges into a single whisper window
+    int pack_window_ms = 29000; // max duration of a packed window (whisper window is 30s)
+    int pack_gap_ms = 1000;     // max silence kept between packed speech ranges
+    int audio_ctx = 0;          // encoder context in 20 ms frames (0 - full 30s context)
+    bool adaptive_audio_ctx = false;    // reduce encoder context to the duration of each input (window)
+    int audio_ctx_margin_ms = 2000;     // extra audio covered by the adaptive context
+    int audio_ctx_min = 256;            // adaptive context floor (in 20 ms frames)
 };
 
 class Whisper {
@@ -200,6 +248,8 @@ public:
 
     void setModel(WhisperModel& model);
     void setVADModel(VADModel& model);
+    // speech ranges of audio seen before are taken from the cache instead of running VAD
+    void setVADCache(std::shared_ptr<VADRangeCache> cache);
 
     Whisper(const Whisper&) = delete;
     Whisper& operator=(const Whisper&) = delete;
@@ -213,6 +263,8 @@ public:
     // bool operator()(const float* samples, size_t count, const std::string& lang = "auto", bool reset = false, bool use_vad = false, VADConfig vad_config = VADConfig());
     WhisperReturnValue operator()(const void* wav_data, size_t wav_size, const WhisperJobConfig& config = WhisperJobConfig());
     WhisperReturnValue operator()(const float* samples, size_t count, const WhisperJobConfig& config = WhisperJobConfig());
+    // input still arriving (e.g., an upload): count is the expected length, transcription starts on the first speech range
+    WhisperReturnValue operator()(const float* samples, size_t count, const WhisperJobConfig& config, SampleWait wait);
 
     void abort();
     size_t numberOfSegments() const;
@@ -235,9 +287,12 @@ typedef std::string WhisperJobID;
 
 struct WhisperJob {
     SharedBuffer<float> samples;
+    SharedBuffer<int16_t> samples_s16;  // 16-bit form of samples, the queue converts to and keeps only this one
     SharedBuffer<void> wav;
     WhisperJobConfig config = WhisperJobConfig();
     WhisperJobID id;
+    int priority = 0;       // higher priority jobs are scheduled first
+    std::string client;     // key for fair sharing between clients (e.g., document or access key)
 };
 
 enum class WhisperJobStatus {
@@ -249,6 +304,37 @@ enum class WhisperJobStatus {
     Stored
 };
 
+enum class WhisperSchedulingPolicy {
+    FIFO,
+    ShortestFirst,  // shortest audio first, waiting time counts against duration (aging)
+};
+
+struct WhisperJobQueueInfo {
+    size_t position = 0;    // jobs to be started before this one
+    double eta_s = 0;       // estimated time until the job starts
+};
+
+struct WhisperAdmission {
+    bool accepted = true;
+    bool permanent = false;     // the job alone exceeds a limit, retrying will not help
+    double retry_after_s = 0;   // estimated time until the job would fit into the limits
+    std::string reason;         // limit that was hit: jobs, audio or bytes
+};
+
+struct WhisperQueueStats {
+    size_t jobs = 0;            // jobs kept in memory
+    size_t retained_bytes = 0;  // estimated memory held by results of finished jobs
+    size_t evicted = 0;         // finished jobs evicted from memory
+    size_t spilled = 0;         // evicted jobs written to the spill storage
+    size_t restored = 0;        // evicted jobs loaded back from the spill storage
+    size_t preempted = 0;       // times a running job was suspended for a more urgent one
+    size_t queued_jobs = 0;     // waiting jobs
+    double queued_audio_s = 0;  // audio duration of waiting jobs
+    size_t queued_bytes = 0;    // sample memory of waiting jobs
+    size_t rejected = 0;        // jobs not admitted because of the queue limits
+    size_t spilled_audio = 0;   // waiting jobs whose audio was written to files
+};
+
 class WhisperQueueProcessorImpl;
 
 class WhisperQueueProcessor {
@@ -261,6 +347,10 @@ public:
     Whisper newWhisperInstance();
 
     void setVADModel(VADModel& vad_model);
+    void setVADCache(std::shared_ptr<VADRangeCache> cache);
+
+    // transcribe VAD speech ranges of a single job in parallel on all instances
+    void setSplitRanges(bool enable);
 
     typedef int instance_id;
     typedef int job_id;
@@ -268,10 +358,42 @@ public:
     std::optional<WhisperJobStatus> getJobStatus(WhisperJobID id);
 
     WhisperJobID add(WhisperJob&& job);
+
+    // limits on waiting jobs (0 - unlimited), checked by tryAdd() and checkAdmission()
+    void setAdmissionLimits(size_t max_jobs, double max_audio_s, size_t max_bytes);
+    // estimated as tryAdd() would count a job of this much audio
+    WhisperAdmission checkAdmission(double audio_s);
+    // adds the job only if it fits into the admission limits
+    std::optional<WhisperJobID> tryAdd(WhisperJob&& job, WhisperAdmission& admission);
     std::optional<WhisperJobStatus> wait(WhisperJobID id, const std::function<bool(const WhisperSegments&, size_t)>& callback);
-    optional_ref<const WhisperSegments> getResults(WhisperJobID id);
+    std::shared_ptr<const WhisperSegments> getResults(WhisperJobID id);
     bool abort(WhisperJobID id);
 
+    // audio is freed as soon as a job is finished; finished jobs are kept for ttl_s seconds (0 - forever)
+    // and within max_bytes of results (0 - unlimited), least recently accessed jobs are evicted first
+    void setRetention(int ttl_s, size_t max_bytes);
+
+    // evicted jobs are passed to store, jobs no longer in memory are looked up with load
+    typedef std::function<bool(const WhisperJobID&, WhisperJobStatus, const WhisperSegments&)> SpillStore;
+    typedef std::function<std::optional<std::pair<WhisperJobStatus, WhisperSegments>>(const WhisperJobID&)> SpillLoad;
+    void setSpill(SpillStore store, SpillLoad load);
+
+    // audio of new waiting jobs over max_resident_bytes of waiting job audio is written to files in directory
+    // and memory mapped when the job starts
+    void setAudioSpill(const std::string& directory, size_t max_resident_bytes);
+
+    WhisperQueueStats getStats();
+
+    // aging - seconds of audio duration forgiven per second of waiting; with fair share clients with fewer running jobs go first
+    void setScheduling(WhisperSchedulingPolicy policy, bool fair_share = false, double aging = 10.0);
+
+    // long running jobs yield at VAD range boundaries to waiting jobs of higher priority, or (shortest first)
+    // to jobs up to short_job_s long, after running for at least min_run_s
+    void setPreemption(bool enable, double short_job_s = 60, double min_run_s = 10);
+
+    // queue position of a waiting job
+    std::optional<WhisperJobQueueInfo> getQueueInfo(WhisperJobID id);
+
 private:
     std::unique_ptr<WhisperQueueProcessorImpl> impl;
     WhisperModel* model = nullptr;
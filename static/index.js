@@ -512,9 +512,22 @@ async function main() {
     try {
       // const language = 'auto';
       const language = 'lv';
+
+      // do not upload if the queue is full anyway
+      const admission = await fetch(`./api/whisper/admission?size=${audio.size}&duration=${waveform.getDuration() || 0}`);
+      if (admission.ok) {
+        const { accepted, retry_after } = await admission.json();
+        if (!accepted) {
+          setState('error', retry_after ? `server busy, try again in ${retry_after} s` : 'audio too long');
+          hide(dom.topSpinner);
+          return;
+        }
+      }
+
       const formData = new FormData();
-      formData.append('input', audio, 'dummy');
+      // the language first, so that the server may start before the whole input is received
       formData.append('lang', language);
+      formData.append('input', audio, 'dummy');
 
       // const response = await fetch(`./api/whisper`, { method: 'POST', body: formData, headers: { 'Accept': 'application/json' } });
       const response = await fetch(`./api/whisper?q=t`, { method: 'POST', body: formData, headers: { 'Accept': 'application/json' } });
@@ -522,8 +535,11 @@ async function main() {
       if (!response.ok) {
         if (response.status == 413) {
           setState('error', 'payload too large');
+        } else if (response.status == 429) {
+          setState('error', `server busy, try again in ${response.headers.get('Retry-After') || 60} s`);
+        } else {
+          setState('error');
         }
-        setState('error');
         hide(dom.topSpinner);
         return;
       }
@@ -726,8 +742,8 @@ async function main() {
         console.log(audio)
         const language = 'auto';
         const formData = new FormData();
-        formData.append('input', audio, 'dummy');
         formData.append('lang', language);
+        formData.append('input', audio, 'dummy');
 
         const response = await fetch(`./api/whisper`, { method: 'POST', body: formData, headers: { 'Accept': 'application/json' } });
 
@@ -872,8 +888,8 @@ async function main() {
     try {
       const language = 'auto';
       const formData = new FormData();
-      formData.append('input', audio, 'dummy');
       formData.append('lang', language);
+      formData.append('input', audio, 'dummy');
 
       const response = await fetch(`./api/whisper`, { method: 'POST', body: formData, headers: { 'Accept': 'application/json' } });
 